@@ -9,13 +9,23 @@
 #include <fcntl.h>
 #include <libudev.h>
 #include <limits.h>
+#include <linux/filter.h>
 #include <linux/input.h>
+#include <linux/netlink.h>
+#include <linux/perf_event.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/select.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <X11/X.h>
@@ -27,6 +37,28 @@
 #include <X11/extensions/sync.h>
 
 #define MAX_INPUT_DEVICES 64
+#define MAX_PENDING_DEVICES 8
+#define PENDING_RETRY_MS 100
+#define PENDING_TRIES 20
+#define UEVENT_BUFSIZE 8192
+#define UEVENT_SCAN_LEN 256
+#define DEFAULT_TIMER_SLACK_MS 20
+#define ENERGY_INTERVAL_MS 1000
+#define MAX_RAPL_ZONES 8
+#define PROFILE_INTERVAL_MS 10000
+#define PROFILE_CALIBRATE_READS 64
+#define QUARANTINE_WINDOW_MS 1000
+#define QUARANTINE_MIN_MS 5000
+#define QUARANTINE_MAX_MS (10 * 60 * 1000)
+#define KEY_BOUNCE_US 10000
+#define USB_SEARCH_DEPTH 8
+#define POLL_INTERVAL_MS 10
+#define POLL_WINDOW_MS 100
+#define DEFAULT_RTT_THRESHOLD_MS 5
+#define RTT_INTERVAL_MS 60000
+#define RTT_SAMPLES 3
+#define LATENCY_BUCKETS 24
+#define PHASE_LOG_LEN 64
 #define DPRINTF(x)                                                             \
   do {                                                                         \
     if (debug) {                                                               \
@@ -34,7 +66,18 @@
     }                                                                          \
   } while (0)
 
+/* Mark the start of a loop phase, for attributing profiling counters */
+#define PHASE(p)                                                               \
+  do {                                                                         \
+    if (perf_fd >= 0)                                                          \
+      profile_phase();                                                         \
+    if (latency_mode)                                                          \
+      phase_mark(p);                                                           \
+    phase = (p);                                                               \
+  } while (0)
+
 /* Forward declarations */
+struct energy_sample;
 static void get_mod_map(void);
 static void free_mod_map(void);
 static void hide_cursor(void);
@@ -45,9 +88,67 @@ static void usage(char *);
 static int swallow_error(Display *, XErrorEvent *);
 static int parse_geometry(const char *s);
 static int test_bit(int bit, unsigned long *array);
-static int add_device(const char *);
+static void add_device(const char *);
+static void add_switch(const char *, const char *, int);
 static void remove_device(const char *);
 static int recompute_max_fd(int udev_fd, int x11_fd);
+struct input_device;
+static void init_device(struct input_device *, int, const char *);
+static void check_gone(struct input_device *, ssize_t);
+static void prune_devices(void);
+static void track_event(struct input_device *, struct input_event *);
+static void check_chatter(struct input_device *, int);
+static int mask_device(struct input_device *, int);
+static void sync_keys(struct input_device *);
+static void release_quarantined(void);
+static void print_device(const char *, struct input_device *, uint64_t);
+static int pointers_needed(void);
+static void release_pointers(void);
+static void reopen_pointers(void);
+static void find_power_dir(struct input_device *);
+static int read_power_ms(const char *, const char *, uint64_t *);
+static void note_unhide(struct input_device *, struct input_event *);
+static void set_clock(struct input_device *);
+static int64_t event_age_ns(struct input_device *, struct input_event *);
+static void note_latency(struct input_device *, struct input_event *, int);
+static void phase_mark(int);
+static int phase_at(uint64_t);
+static void drain_pointer(struct input_device *);
+static void update_polling(struct input_device *, unsigned int);
+static void set_polled(struct input_device *, int);
+static void poll_pointers(void);
+static void poll_arm(void);
+static void track_key(struct input_event *);
+static void track_motion(struct input_device *, struct input_event *);
+static void measure_rtt(void);
+static void probe_dormancy(struct input_device *);
+static int read_inhibited(struct input_device *);
+static void update_dormant(struct input_device *);
+static void update_all_dormant(void);
+static void refresh_inhibited(void);
+static void drain_switch(struct input_device *);
+static void update_switches(void);
+static int udev_receive(struct udev_monitor *);
+static int uevent_open(void);
+static int uevent_receive(int);
+static void retry_pending(void);
+static void print_stats(void);
+static void request_stats(int);
+static uint64_t now_ns(void);
+static void timer_arm(int, unsigned int);
+static void timer_program_at(int, uint64_t);
+static void timer_cancel(int);
+static void timer_program(void);
+static void timer_run(void);
+static void energy_init(void);
+static void energy_read(struct energy_sample *);
+static void energy_tick(void);
+static void print_energy(void);
+static int perf_open(uint64_t, int);
+static void profile_init(void);
+static void profile_calibrate(void);
+static void profile_phase(void);
+static void profile_tick(void);
 
 struct mod_map_entry {
   char *name;
@@ -68,15 +169,216 @@ static int hide_x = 0, hide_y = 0;
 static unsigned int ignored = 0; /* Changed from char to int for bitmasks */
 static XSyncCounter idler_counter = 0;
 static XSyncAlarm idle_alarm = None;
+static int alarm_armed = 0;
+
+/*
+ * Over a slow link every reply costs a round trip, so above the threshold
+ * the daemon stops asking the server and relies on what it tracks itself:
+ * the keys held down and how far the pointer has moved since the hide.
+ */
+static unsigned int rtt_threshold = DEFAULT_RTT_THRESHOLD_MS;
+static int remote = 0, hid_remotely = 0;
+static char keys_down[32];
+static int moved_x = 0, moved_y = 0;
+static Window attrs_win = None;
+static XWindowAttributes attrs_cache;
 
 static int debug = 0;
+static int use_netlink = 0;
+static volatile sig_atomic_t stats_requested = 0;
+
+static struct {
+  unsigned long wakeups;
+  unsigned long input_events;
+  unsigned long key_events;
+  unsigned long pointer_events;
+  unsigned long hotplug_wakeups;
+  unsigned long hotplug_events;
+  unsigned long quarantines;
+  unsigned long reopens;
+  uint64_t reopen_ns, reopen_max_ns;
+  /* Indexed by whether the pointer was being polled up to the hide */
+  unsigned long unhides[2];
+  uint64_t unhide_ns[2], unhide_max_ns[2];
+  unsigned long poll_wakeups;
+  uint64_t poll_ns;
+  unsigned long rtt_samples;
+  uint64_t rtt_ns, rtt_min_ns, rtt_max_ns;
+} stats;
+static uint64_t start_time;
+
+/*
+ * Energy accounting (-e): every interval is attributed to the workload seen
+ * during it, so changes to the loop can be compared per kind of activity.
+ */
+enum workloads {
+  LOAD_IDLE,
+  LOAD_TYPING,
+  LOAD_POINTING,
+  NUM_LOADS,
+};
+static const char *load_names[NUM_LOADS] = {"idle", "typing", "pointing"};
+
+struct energy_sample {
+  uint64_t energy_uj; /* RAPL, whole package */
+  uint64_t cpu_ns, wait_ns, slices;
+  uint64_t nvcsw, nivcsw;
+  uint64_t wakeups, key_events, pointer_events;
+};
+
+static int energy_mode = 0;
+static int rapl_fds[MAX_RAPL_ZONES];
+static uint64_t rapl_range[MAX_RAPL_ZONES], rapl_last[MAX_RAPL_ZONES];
+static int num_rapl = 0;
+static int schedstat_fd = -1;
+static struct energy_sample energy_last;
+static struct {
+  uint64_t intervals;
+  struct energy_sample sum;
+} energy_loads[NUM_LOADS];
+
+/*
+ * Self-profiling (-P): a group of hardware counters on the daemon itself,
+ * read whenever the loop moves from one phase to the next.
+ */
+enum loop_phases {
+  PHASE_POLL,
+  PHASE_READ,
+  PHASE_CLASSIFY,
+  PHASE_DECIDE,
+  PHASE_X,
+  PHASE_HOTPLUG,
+  PHASE_TIMER,
+  NUM_PHASES,
+};
+static const char *phase_names[NUM_PHASES] = {
+    "poll", "read", "classify", "decide", "x", "hotplug", "timer"};
+
+enum perf_counters {
+  CTR_CYCLES,
+  CTR_INSTRUCTIONS,
+  CTR_CACHE_MISSES,
+  CTR_BRANCH_MISSES,
+  NUM_COUNTERS,
+};
+static const uint64_t perf_configs[NUM_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+static int profile_mode = 0;
+static int phase = PHASE_POLL;
+static int perf_fd = -1;
+static int perf_exclude_kernel = 0;
+static uint64_t perf_last[NUM_COUNTERS];
+static uint64_t perf_read_cost[NUM_COUNTERS]; /* of one read(), calibrated */
+static uint64_t perf_phases[NUM_PHASES][NUM_COUNTERS];
+static unsigned long perf_events_base, perf_wakeups_base;
+
+/*
+ * Delivery latency (-l): how long events wait between the kernel stamping
+ * them and us reading them.  Phase changes are timestamped so a late batch
+ * can be blamed on whatever the loop was doing when it arrived.
+ */
+static int latency_mode = 0;
+static uint64_t latency_log_ns = 0;
+static struct {
+  uint64_t when;
+  int phase;
+} phase_log[PHASE_LOG_LEN];
+static unsigned int phase_log_head = 0;
+
+/*
+ * Every deadline the daemon keeps locally is a slot in this table, and all
+ * of them share one timerfd.  A timer may fire anywhere between its deadline
+ * and its deadline plus the slack, which lets nearby deadlines be served by
+ * a single wakeup.
+ */
+enum timer_ids {
+  TIMER_PENDING,
+  TIMER_ENERGY,
+  TIMER_PROFILE,
+  TIMER_QUARANTINE,
+  TIMER_POLL,
+  TIMER_RTT,
+  NUM_TIMERS,
+};
+
+static struct timer {
+  uint64_t when; /* CLOCK_MONOTONIC ns, 0 when disarmed */
+  void (*fn)(void);
+} timers[NUM_TIMERS] = {
+    [TIMER_PENDING] = {0, retry_pending},
+    [TIMER_ENERGY] = {0, energy_tick},
+    [TIMER_PROFILE] = {0, profile_tick},
+    [TIMER_QUARANTINE] = {0, release_quarantined},
+    [TIMER_POLL] = {0, poll_pointers},
+    [TIMER_RTT] = {0, measure_rtt},
+};
+static int timer_fd = -1;
+static uint64_t timer_slack = DEFAULT_TIMER_SLACK_MS * 1000000ULL;
+static uint64_t timer_programmed = 0;
+
+/* Nodes announced by the kernel before udev has fixed their permissions */
+static struct {
+  char path[64];
+  int tries;
+} pending[MAX_PENDING_DEVICES];
+static int num_pending = 0;
+
+struct input_device {
+  int fd;
+  char *path;
+  int gone; /* read() said ENODEV; removed at the top of the loop */
+
+  /* Chatter detection over the current window */
+  uint64_t window_start;
+  unsigned int window_events, window_meaningful;
+  int axis_last[2], axis_dir[2];
+  int last_key;
+  struct timeval last_key_time;
+
+  /* Quarantine: not polled (and masked, if possible) until the deadline */
+  int quarantined;
+  uint64_t quarantine_until;
+  unsigned int backoff_ms;
+  unsigned int quarantines;
+
+  /* Runtime PM of the USB device behind a pointer, for -p */
+  char *power_dir;
+  uint64_t suspended_base, active_base;
+
+  /* Interval polling of busy pointers, for -r */
+  int polled, was_polled;
+  uint64_t rate_start;
+  unsigned int rate_events;
+
+  /* Not read while inhibited, or built in and the lid or tablet mode says so */
+  int internal, direct, inhibited, dormant;
+  unsigned int switch_state; /* switch devices: bits by SW_LID, SW_TABLET_MODE */
+
+  /* Last absolute position, for measuring motion locally when remote */
+  int motion_last[2], motion_has_last[2];
+
+  /* Event timestamps, and for -l how late they are read (log2 usec) */
+  clockid_t clock;
+  unsigned long latency_hist[LATENCY_BUCKETS];
+  uint64_t latency_max_ns;
+  int latency_max_phase;
+};
 
-static int keyboard_fds[MAX_INPUT_DEVICES];
-static char *keyboard_paths[MAX_INPUT_DEVICES];
+static struct input_device keyboards[MAX_INPUT_DEVICES];
 static int num_keyboards = 0;
-static int mouse_fds[MAX_INPUT_DEVICES];
-static char *mouse_paths[MAX_INPUT_DEVICES];
+static struct input_device mice[MAX_INPUT_DEVICES];
 static int num_mice = 0;
+static struct input_device switches[MAX_INPUT_DEVICES];
+static int num_switches = 0;
+static int lid_closed = 0, tablet_mode = 0;
+static int devices_gone = 0;
+static unsigned int quarantine_rate = 0;
+static int power_save = 0;
+static unsigned int poll_rate = 0;
+static int num_polled = 0;
+static uint64_t polled_since;
 
 static int move = 0, move_x, move_y, move_custom_x, move_custom_y,
            move_custom_mask;
@@ -92,22 +394,27 @@ enum move_types {
   MOVE_CUSTOM,
 };
 
-static int add_device(const char *path) {
+static void add_device(const char *path) {
   int fd, i;
   char name[256];
   unsigned long ev_bits[EV_MAX / (sizeof(long) * 8) + 1];
   unsigned long key_bits[KEY_MAX / (sizeof(long) * 8) + 1];
+  unsigned long sw_bits[SW_MAX / (sizeof(long) * 8) + 1];
+  int is_switch;
 
   for (i = 0; i < num_keyboards; i++)
-    if (strcmp(keyboard_paths[i], path) == 0)
-      return 0;
+    if (strcmp(keyboards[i].path, path) == 0)
+      return;
   for (i = 0; i < num_mice; i++)
-    if (strcmp(mouse_paths[i], path) == 0)
-      return 0;
+    if (strcmp(mice[i].path, path) == 0)
+      return;
+  for (i = 0; i < num_switches; i++)
+    if (strcmp(switches[i].path, path) == 0)
+      return;
 
   if ((fd = open(path, O_RDONLY | O_NONBLOCK)) < 0) {
     warn("add_device: can't open %s", path);
-    return 0;
+    return;
   }
 
   if (ioctl(fd, EVIOCGNAME(sizeof(name)), name) < 0) {
@@ -118,19 +425,27 @@ static int add_device(const char *path) {
   memset(ev_bits, 0, sizeof(ev_bits));
   if (ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits) < 0) {
     close(fd);
-    return 0;
+    return;
   }
 
+  /* Check for Lid and Tablet Mode Switches, often on the keyboard itself */
+  memset(sw_bits, 0, sizeof(sw_bits));
+  is_switch =
+      test_bit(EV_SW, ev_bits) && num_switches < MAX_INPUT_DEVICES &&
+      ioctl(fd, EVIOCGBIT(EV_SW, sizeof(sw_bits)), sw_bits) >= 0 &&
+      (test_bit(SW_LID, sw_bits) || test_bit(SW_TABLET_MODE, sw_bits));
+
   /* Check for Keyboard */
   if (test_bit(EV_KEY, ev_bits) && num_keyboards < MAX_INPUT_DEVICES) {
     memset(key_bits, 0, sizeof(key_bits));
     if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits) >= 0) {
       if (test_bit(KEY_SPACE, key_bits)) {
         DPRINTF(("found keyboard: %s (%s)\n", path, name));
-        keyboard_fds[num_keyboards] = fd;
-        keyboard_paths[num_keyboards] = strdup(path);
-        num_keyboards++;
-        return fd;
+        init_device(&keyboards[num_keyboards], fd, path);
+        probe_dormancy(&keyboards[num_keyboards++]);
+        if (is_switch)
+          add_switch(path, name, -1);
+        return;
       }
     }
   }
@@ -142,63 +457,154 @@ static int add_device(const char *path) {
     if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits) >= 0) {
       if (test_bit(BTN_MOUSE, key_bits) || test_bit(BTN_TOUCH, key_bits)) {
         DPRINTF(("found pointer: %s (%s)\n", path, name));
-        mouse_fds[num_mice] = fd;
-        mouse_paths[num_mice] = strdup(path);
+        init_device(&mice[num_mice], fd, path);
+        probe_dormancy(&mice[num_mice]);
+        if (power_save) {
+          find_power_dir(&mice[num_mice]);
+          if (!pointers_needed()) {
+            close(fd);
+            mice[num_mice].fd = -1;
+          }
+        }
         num_mice++;
-        return fd;
+        if (is_switch)
+          add_switch(path, name, -1);
+        return;
       }
     }
   }
 
-  close(fd);
-  return 0;
+  if (is_switch)
+    add_switch(path, name, fd);
+  else
+    close(fd);
 }
 
+/*
+ * A switch on a keyboard or pointer gets an open file of its own, so that
+ * masking the device while it is dormant doesn't hide the switch too.
+ */
+static void add_switch(const char *path, const char *name, int fd) {
+  unsigned long sw_bits[SW_MAX / (sizeof(long) * 8) + 1];
+
+  if (fd < 0 && (fd = open(path, O_RDONLY | O_NONBLOCK)) < 0) {
+    warn("add_switch: can't open %s", path);
+    return;
+  }
+  DPRINTF(("found switch: %s (%s)\n", path, name));
+  init_device(&switches[num_switches], fd, path);
+  memset(sw_bits, 0, sizeof(sw_bits));
+  if (ioctl(fd, EVIOCGSW(sizeof(sw_bits)), sw_bits) >= 0)
+    switches[num_switches].switch_state =
+        test_bit(SW_LID, sw_bits) << SW_LID |
+        test_bit(SW_TABLET_MODE, sw_bits) << SW_TABLET_MODE;
+  num_switches++;
+  update_switches();
+}
+
+/* A keyboard or pointer may also be listed as a switch */
 static void remove_device(const char *path) {
   int i, j;
 
   for (i = 0; i < num_keyboards; i++) {
-    if (keyboard_paths[i] && strcmp(keyboard_paths[i], path) == 0) {
+    if (keyboards[i].path && strcmp(keyboards[i].path, path) == 0) {
       DPRINTF(("removing keyboard: %s\n", path));
-      close(keyboard_fds[i]);
-      free(keyboard_paths[i]);
+      close(keyboards[i].fd);
+      free(keyboards[i].path);
 
-      for (j = i; j < num_keyboards - 1; j++) {
-        keyboard_fds[j] = keyboard_fds[j + 1];
-        keyboard_paths[j] = keyboard_paths[j + 1];
-      }
+      for (j = i; j < num_keyboards - 1; j++)
+        keyboards[j] = keyboards[j + 1];
       num_keyboards--;
-      return;
+      break;
     }
   }
 
   for (i = 0; i < num_mice; i++) {
-    if (mouse_paths[i] && strcmp(mouse_paths[i], path) == 0) {
+    if (mice[i].path && strcmp(mice[i].path, path) == 0) {
       DPRINTF(("removing pointer: %s\n", path));
-      close(mouse_fds[i]);
-      free(mouse_paths[i]);
-
-      for (j = i; j < num_mice - 1; j++) {
-        mouse_fds[j] = mouse_fds[j + 1];
-        mouse_paths[j] = mouse_paths[j + 1];
-      }
+      set_polled(&mice[i], 0);
+      if (mice[i].fd >= 0)
+        close(mice[i].fd);
+      free(mice[i].path);
+      free(mice[i].power_dir);
+
+      for (j = i; j < num_mice - 1; j++)
+        mice[j] = mice[j + 1];
       num_mice--;
+      break;
+    }
+  }
+
+  for (i = 0; i < num_switches; i++) {
+    if (switches[i].path && strcmp(switches[i].path, path) == 0) {
+      DPRINTF(("removing switch: %s\n", path));
+      close(switches[i].fd);
+      free(switches[i].path);
+
+      for (j = i; j < num_switches - 1; j++)
+        switches[j] = switches[j + 1];
+      num_switches--;
+      update_switches();
       return;
     }
   }
 }
 
+/*
+ * A device unplugged without us hearing about it stays readable forever,
+ * with every read failing, so it has to be dropped from the loop.
+ */
+static void check_gone(struct input_device *d, ssize_t len) {
+  if (len < 0 && errno == ENODEV) {
+    d->gone = 1;
+    devices_gone = 1;
+  }
+}
+
+/* Drop devices that failed with ENODEV or whose node has disappeared */
+static void prune_devices(void) {
+  struct input_device *all[3] = {keyboards, mice, switches};
+  int *counts[3] = {&num_keyboards, &num_mice, &num_switches};
+  char path[PATH_MAX];
+  int i, j;
+
+  devices_gone = 0;
+  for (j = 0; j < 3; j++) {
+    for (i = *counts[j] - 1; i >= 0; i--) {
+      if (!all[j][i].gone && access(all[j][i].path, F_OK) == 0)
+        continue;
+      snprintf(path, sizeof(path), "%s", all[j][i].path);
+      remove_device(path);
+    }
+  }
+}
+
 static int recompute_max_fd(int udev_fd, int x11_fd) {
   int max = (udev_fd > x11_fd) ? udev_fd : x11_fd;
+  if (timer_fd > max)
+    max = timer_fd;
   for (int i = 0; i < num_keyboards; i++)
-    if (keyboard_fds[i] > max)
-      max = keyboard_fds[i];
+    if (keyboards[i].fd > max)
+      max = keyboards[i].fd;
   for (int i = 0; i < num_mice; i++)
-    if (mouse_fds[i] > max)
-      max = mouse_fds[i];
+    if (mice[i].fd > max)
+      max = mice[i].fd;
+  for (int i = 0; i < num_switches; i++)
+    if (switches[i].fd > max)
+      max = switches[i].fd;
   return max;
 }
 
+static void init_device(struct input_device *d, int fd, const char *path) {
+  memset(d, 0, sizeof(*d));
+  d->fd = fd;
+  d->path = strdup(path);
+  d->last_key = -1;
+  d->backoff_ms = QUARANTINE_MIN_MS;
+  d->latency_max_phase = -1;
+  set_clock(d);
+}
+
 int main(int argc, char *argv[]) {
   int ch, i;
   XEvent e;
@@ -215,7 +621,7 @@ int main(int argc, char *argv[]) {
       {"mod4", Mod4Mask},   {"mod5", Mod5Mask}, {"all", -1},
   };
 
-  while ((ch = getopt(argc, argv, "ac:di:j:m:t:s")) != -1)
+  while ((ch = getopt(argc, argv, "ac:dei:j:l:m:npPq:r:R:t:sw:")) != -1)
     switch (ch) {
     case 'a':
       always_hide = 1;
@@ -226,6 +632,9 @@ int main(int argc, char *argv[]) {
     case 'd':
       debug = 1;
       break;
+    case 'e':
+      energy_mode = 1;
+      break;
     case 'i':
       for (i = 0; i < (int)(sizeof(mods) / sizeof(struct mod_lookup)); i++)
         if (strcasecmp(optarg, mods[i].name) == 0)
@@ -236,6 +645,10 @@ int main(int argc, char *argv[]) {
     case 'j':
       jitter = strtoul(optarg, NULL, 0);
       break;
+    case 'l':
+      latency_mode = 1;
+      latency_log_ns = strtoul(optarg, NULL, 0) * 1000000ULL;
+      break;
     case 'm':
       if (strcmp(optarg, "nw") == 0)
         move = MOVE_NW;
@@ -260,21 +673,45 @@ int main(int argc, char *argv[]) {
         usage(argv[0]);
       }
       break;
+    case 'n':
+      use_netlink = 1;
+      break;
+    case 'p':
+      power_save = 1;
+      break;
+    case 'P':
+      profile_mode = 1;
+      break;
+    case 'q':
+      quarantine_rate = strtoul(optarg, NULL, 0);
+      break;
+    case 'r':
+      poll_rate = strtoul(optarg, NULL, 0);
+      break;
+    case 'R':
+      rtt_threshold = strtoul(optarg, NULL, 0);
+      break;
     case 't':
       timeout = strtoul(optarg, NULL, 0);
       break;
     case 's':
       ignore_scroll = 1;
       break;
+    case 'w':
+      timer_slack = strtoul(optarg, NULL, 0) * 1000000ULL;
+      break;
     default:
       usage(argv[0]);
     }
 
+  start_time = now_ns();
+
   if (!(dpy = XOpenDisplay(NULL)))
     errx(1, "can't open display %s", XDisplayName(NULL));
 
   get_mod_map();
   atexit(free_mod_map);
+  XQueryKeymap(dpy, keys_down);
 
   XSetErrorHandler(swallow_error);
 
@@ -302,44 +739,90 @@ int main(int argc, char *argv[]) {
   if (always_hide)
     hide_cursor();
 
-  /* Udev Setup */
-  struct udev *udev = udev_new();
-  if (!udev)
-    errx(1, "udev_new() failed");
-  struct udev_monitor *mon = udev_monitor_new_from_netlink(udev, "udev");
-  if (!mon)
-    errx(1, "udev_monitor failed");
-  udev_monitor_filter_add_match_subsystem_devtype(mon, "input", NULL);
-  udev_monitor_enable_receiving(mon);
-  int udev_fd = udev_monitor_get_fd(mon);
+  /* Hotplug Setup */
+  struct udev *udev = NULL;
+  struct udev_monitor *mon = NULL;
+  int udev_fd;
+  if (use_netlink) {
+    if ((udev_fd = uevent_open()) < 0)
+      err(1, "can't open uevent socket");
+  } else {
+    if (!(udev = udev_new()))
+      errx(1, "udev_new() failed");
+    if (!(mon = udev_monitor_new_from_netlink(udev, "udev")))
+      errx(1, "udev_monitor failed");
+    udev_monitor_filter_add_match_subsystem_devtype(mon, "input", NULL);
+    udev_monitor_enable_receiving(mon);
+    udev_fd = udev_monitor_get_fd(mon);
+  }
+
+  if ((timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                 TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+    err(1, "timerfd_create failed");
+
+  measure_rtt();
+  if (energy_mode)
+    energy_init();
+  if (profile_mode)
+    profile_init();
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = request_stats;
+  sigaction(SIGUSR1, &sa, NULL);
 
   /* Main Loop Setup */
   int x11_fd = ConnectionNumber(dpy);
   fd_set fds;
-  int max_fd = recompute_max_fd(udev_fd, x11_fd);
+  int max_fd, queued, batch;
+  ssize_t len;
   struct input_event ev;
+  struct timeval zero;
 
   for (;;) {
+    if (stats_requested) {
+      stats_requested = 0;
+      print_stats();
+    }
+    if (devices_gone)
+      prune_devices();
+
+    PHASE(PHASE_POLL);
     FD_ZERO(&fds);
     FD_SET(udev_fd, &fds);
     FD_SET(x11_fd, &fds);
+    FD_SET(timer_fd, &fds);
     for (i = 0; i < num_keyboards; i++)
-      FD_SET(keyboard_fds[i], &fds);
+      if (!keyboards[i].quarantined && !keyboards[i].dormant)
+        FD_SET(keyboards[i].fd, &fds);
     for (i = 0; i < num_mice; i++)
-      FD_SET(mouse_fds[i], &fds);
-
-    if (select(max_fd + 1, &fds, NULL, NULL, NULL) == -1) {
+      if (!mice[i].quarantined && !mice[i].dormant && mice[i].fd >= 0 &&
+          !mice[i].polled)
+        FD_SET(mice[i].fd, &fds);
+    for (i = 0; i < num_switches; i++)
+      FD_SET(switches[i].fd, &fds);
+    max_fd = recompute_max_fd(udev_fd, x11_fd);
+
+    /* Round trips may have left events in Xlib's queue, off the socket */
+    zero.tv_sec = zero.tv_usec = 0;
+    queued = XEventsQueued(dpy, QueuedAlready);
+    if (select(max_fd + 1, &fds, NULL, NULL, queued ? &zero : NULL) == -1) {
       if (errno == EINTR)
         continue;
       err(1, "select failed");
     }
+    stats.wakeups++;
+    if (num_polled)
+      stats.poll_wakeups++;
 
     /* Handle X11 Events (Timeouts) */
-    if (FD_ISSET(x11_fd, &fds)) {
+    if (queued || FD_ISSET(x11_fd, &fds)) {
+      PHASE(PHASE_X);
       while (XPending(dpy)) {
         XNextEvent(dpy, &e);
         if (timeout && e.type == sync_event + XSyncAlarmNotify) {
           DPRINTF(("idle timeout reached, hiding cursor\n"));
+          alarm_armed = 0;
           hide_cursor();
         }
       }
@@ -347,31 +830,53 @@ int main(int argc, char *argv[]) {
 
     /* Handle Udev Events (Hotplug) */
     if (FD_ISSET(udev_fd, &fds)) {
-      struct udev_device *dev = udev_monitor_receive_device(mon);
-      if (dev) {
-        const char *action = udev_device_get_action(dev);
-        const char *path = udev_device_get_devnode(dev);
-        if (action && path) {
-          if (strcmp(action, "add") == 0)
-            add_device(path);
-          else if (strcmp(action, "remove") == 0)
-            remove_device(path);
-          max_fd = recompute_max_fd(udev_fd, x11_fd);
-        }
-        udev_device_unref(dev);
-      }
+      PHASE(PHASE_HOTPLUG);
+      stats.hotplug_wakeups++;
+      if (use_netlink)
+        uevent_receive(udev_fd);
+      else
+        udev_receive(mon);
     }
 
+    /* Handle Timers */
+    if (FD_ISSET(timer_fd, &fds)) {
+      PHASE(PHASE_TIMER);
+      timer_run();
+    }
+
+    /* Handle Switches */
+    for (i = 0; i < num_switches; i++)
+      if (FD_ISSET(switches[i].fd, &fds))
+        drain_switch(&switches[i]);
+
     /* Handle Keyboards */
     for (i = 0; i < num_keyboards; i++) {
-      if (FD_ISSET(keyboard_fds[i], &fds)) {
+      if (FD_ISSET(keyboards[i].fd, &fds)) {
         /* Read loop to drain buffer */
-        while (read(keyboard_fds[i], &ev, sizeof(ev)) == sizeof(ev)) {
+        PHASE(PHASE_READ);
+        batch = 0;
+        while ((len = read(keyboards[i].fd, &ev, sizeof(ev))) ==
+               sizeof(ev)) {
+          stats.input_events++;
+          if (latency_mode)
+            note_latency(&keyboards[i], &ev, batch++ == 0);
+          PHASE(PHASE_CLASSIFY);
+          track_event(&keyboards[i], &ev);
+          if (ev.type == EV_KEY)
+            track_key(&ev);
           if (ev.type == EV_KEY && ev.value == 1) { /* Key Press */
+            stats.key_events++;
             char keys_return[32];
-            XQueryKeymap(dpy, keys_return);
             int ignore_keystroke = 0;
 
+            /* The server is only asked when modifiers matter at all */
+            if (ignored && !remote) {
+              PHASE(PHASE_X);
+              XQueryKeymap(dpy, keys_return);
+            } else
+              memcpy(keys_return, keys_down, sizeof(keys_return));
+            PHASE(PHASE_CLASSIFY);
+
             for (int j = 0; j < mod_map_count; j++) {
               if (mod_map[j].mask & ignored) {
                 for (int k = 0; k < mod_map[j].keycode_count; k++) {
@@ -384,49 +889,220 @@ int main(int argc, char *argv[]) {
               }
             }
           check_ignore:
+            PHASE(PHASE_DECIDE);
             if (!ignore_keystroke) {
               current_keystrokes++;
-              if (current_keystrokes >= keystroke_count)
+              if (current_keystrokes >= keystroke_count) {
+                PHASE(PHASE_X);
                 hide_cursor();
+              }
             }
           }
+          PHASE(PHASE_READ);
         }
+        PHASE(PHASE_CLASSIFY);
+        check_gone(&keyboards[i], len);
+        check_chatter(&keyboards[i], 1);
       }
     }
 
     /* Handle Mice */
     for (i = 0; i < num_mice; i++) {
-      if (FD_ISSET(mouse_fds[i], &fds)) {
-        while (read(mouse_fds[i], &ev, sizeof(ev)) == sizeof(ev)) {
-          if (ev.type == EV_REL || ev.type == EV_ABS) {
-            if (!always_hide)
-              show_cursor();
-          } else if (ev.type == EV_KEY && ev.value == 1) {
-            if (!always_hide)
-              show_cursor();
-          }
-        }
-      }
+      if (mice[i].fd >= 0 && FD_ISSET(mice[i].fd, &fds))
+        drain_pointer(&mice[i]);
     }
   }
 }
 
+/*
+ * Count an event towards the device's chatter window.  Keyboards only count
+ * key presses, and a press that follows the release of the same key within
+ * KEY_BOUNCE_US is switch bounce.  For pointers, motion that reverses
+ * direction on every report is sensor noise rather than movement.
+ */
+static void track_event(struct input_device *d, struct input_event *ev) {
+  int axis, delta, dir;
+
+  switch (ev->type) {
+  case EV_KEY:
+    if (ev->value == 0) {
+      d->last_key = ev->code;
+      d->last_key_time = ev->time;
+      return;
+    }
+    if (ev->value != 1)
+      return;
+    d->window_events++;
+    if (ev->code != d->last_key ||
+        (ev->time.tv_sec - d->last_key_time.tv_sec) * 1000000 +
+                ev->time.tv_usec - d->last_key_time.tv_usec >=
+            KEY_BOUNCE_US)
+      d->window_meaningful++;
+    return;
+  case EV_REL:
+  case EV_ABS:
+    d->window_events++;
+    axis = ev->code == REL_X || ev->code == ABS_X   ? 0
+           : ev->code == REL_Y || ev->code == ABS_Y ? 1
+                                                    : -1;
+    if (axis < 0) {
+      d->window_meaningful++;
+      return;
+    }
+    /* REL_X == ABS_X and REL_Y == ABS_Y, so the axis lookup is shared */
+    delta = ev->type == EV_REL ? ev->value : ev->value - d->axis_last[axis];
+    d->axis_last[axis] = ev->value;
+    dir = (delta > 0) - (delta < 0);
+    if (dir != -d->axis_dir[axis] || dir == 0)
+      d->window_meaningful++;
+    d->axis_dir[axis] = dir;
+    return;
+  }
+}
+
+/*
+ * At the end of each window, quarantine devices that produced events far
+ * faster than a person can while most of them were noise.  Keyboards only
+ * count presses, so they are held to a tenth of the rate (but at least 1).
+ */
+static void check_chatter(struct input_device *d, int keyboard) {
+  uint64_t now = now_ns(), elapsed = now - d->window_start;
+  unsigned int limit = quarantine_rate;
+  uint64_t rate;
+
+  if (keyboard && (limit /= 10) == 0)
+    limit = 1;
+
+  if (elapsed < QUARANTINE_WINDOW_MS * 1000000ULL)
+    return;
+  rate = d->window_events * 1000000000ULL / elapsed;
+
+  if (quarantine_rate && rate >= limit &&
+      d->window_meaningful * 2 < d->window_events) {
+    warnx("quarantining %s for %us: %llu events/s, %u%% meaningful", d->path,
+          d->backoff_ms / 1000, (unsigned long long)rate,
+          d->window_meaningful * 100 / d->window_events);
+    d->quarantined = 1;
+    d->quarantine_until = now + d->backoff_ms * 1000000ULL;
+    d->quarantines++;
+    stats.quarantines++;
+    mask_device(d, 1);
+    timer_program_at(TIMER_QUARANTINE, d->quarantine_until);
+  } else if (d->window_events && d->backoff_ms > QUARANTINE_MIN_MS &&
+             rate < limit) {
+    /* Behaved for a whole window since its last release */
+    d->backoff_ms = QUARANTINE_MIN_MS;
+  }
+
+  d->window_start = now;
+  d->window_events = d->window_meaningful = 0;
+}
+
+/*
+ * Stop the kernel from queueing events for us at all while quarantined, so
+ * a chattering device costs nothing.  Older kernels lack EVIOCSMASK; there
+ * the backlog is discarded on release instead.
+ */
+static int mask_device(struct input_device *d, int masked) {
+  unsigned long types = masked ? 0 : ~0UL;
+  struct input_mask mask = {EV_SYN, sizeof(types), (uintptr_t)&types};
+  struct input_event ev;
+
+  if (ioctl(d->fd, EVIOCSMASK, &mask) == 0) {
+    if (!masked)
+      sync_keys(d);
+    return 0;
+  }
+  if (!masked) {
+    while (read(d->fd, &ev, sizeof(ev)) == sizeof(ev))
+      ;
+    sync_keys(d);
+  }
+  return -1;
+}
+
+/*
+ * Key releases missed while a device was masked would leave keys looking
+ * held, so take the device's own keys from the kernel's view of them.
+ */
+static void sync_keys(struct input_device *d) {
+  unsigned long key_bits[KEY_MAX / (sizeof(long) * 8) + 1];
+  unsigned long down[KEY_MAX / (sizeof(long) * 8) + 1];
+  unsigned int code, keycode;
+
+  memset(key_bits, 0, sizeof(key_bits));
+  memset(down, 0, sizeof(down));
+  if (ioctl(d->fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits) < 0 ||
+      ioctl(d->fd, EVIOCGKEY(sizeof(down)), down) < 0)
+    return;
+  for (code = 0; code + 8 < sizeof(keys_down) * 8; code++) {
+    if (!test_bit(code, key_bits))
+      continue;
+    keycode = code + 8;
+    if (test_bit(code, down))
+      keys_down[keycode >> 3] |= 1 << (keycode & 7);
+    else
+      keys_down[keycode >> 3] &= ~(1 << (keycode & 7));
+  }
+}
+
+static void release_quarantined(void) {
+  struct input_device *all[2] = {keyboards, mice};
+  int counts[2] = {num_keyboards, num_mice};
+  uint64_t now = now_ns(), next = 0;
+  struct input_device *d;
+  int i, j;
+
+  for (j = 0; j < 2; j++) {
+    for (i = 0; i < counts[j]; i++) {
+      d = &all[j][i];
+      if (!d->quarantined)
+        continue;
+      if (d->quarantine_until <= now) {
+        DPRINTF(("releasing %s from quarantine\n", d->path));
+        /* A closed pointer gets its mask back when reopened */
+        if (!d->dormant && d->fd >= 0)
+          mask_device(d, 0);
+        d->quarantined = 0;
+        d->window_start = now;
+        d->window_events = d->window_meaningful = 0;
+        if (d->backoff_ms < QUARANTINE_MAX_MS)
+          d->backoff_ms *= 2;
+      } else if (next == 0 || d->quarantine_until < next)
+        next = d->quarantine_until;
+    }
+  }
+  if (next)
+    timer_program_at(TIMER_QUARANTINE, next);
+}
+
 static void hide_cursor(void) {
   Window win;
   XWindowAttributes attrs;
-  int x = 0, y = 0, h, w, junk;
+  struct input_event ev;
+  int x = 0, y = 0, h, w, junk, i;
   unsigned int ujunk;
 
   if (hiding)
     return;
   DPRINTF(("hiding cursor\n"));
-
-  if (XQueryPointer(dpy, DefaultRootWindow(dpy), &win, &win, &hide_x, &hide_y,
-                    &junk, &junk, &ujunk)) {
+  moved_x = moved_y = 0;
+  hid_remotely = remote;
+
+  /* Remotely, -j goes by local deltas and only -m needs the position */
+  if (remote && !move)
+    ;
+  else if (XQueryPointer(dpy, DefaultRootWindow(dpy), &win, &win, &hide_x,
+                         &hide_y, &junk, &junk, &ujunk)) {
     if (move) {
       move_x = hide_x;
       move_y = hide_y;
-      XGetWindowAttributes(dpy, win, &attrs);
+      if (move >= MOVE_WIN_NW && move <= MOVE_WIN_SE &&
+          (!remote || win != attrs_win)) {
+        XGetWindowAttributes(dpy, win, &attrs_cache);
+        attrs_win = win;
+      }
+      attrs = attrs_cache;
       h = XHeightOfScreen(DefaultScreenOfDisplay(dpy));
       w = XWidthOfScreen(DefaultScreenOfDisplay(dpy));
 
@@ -479,6 +1155,26 @@ static void hide_cursor(void) {
   XFixesHideCursor(dpy, DefaultRootWindow(dpy));
   XFlush(dpy);
   hiding = 1;
+
+  /* Inhibiting a device sends no uevent, so look again now and then */
+  refresh_inhibited();
+
+  /*
+   * Show latency matters again, so stop polling.  Whatever is still queued
+   * predates the hide and must not undo it.
+   */
+  for (i = 0; i < num_mice; i++) {
+    mice[i].motion_has_last[0] = mice[i].motion_has_last[1] = 0;
+    mice[i].was_polled = mice[i].polled;
+    if (mice[i].polled) {
+      set_polled(&mice[i], 0);
+      while (read(mice[i].fd, &ev, sizeof(ev)) == sizeof(ev))
+        stats.input_events++;
+    }
+  }
+
+  if (power_save && pointers_needed())
+    reopen_pointers();
 }
 
 static void show_cursor(void) {
@@ -495,7 +1191,10 @@ static void show_cursor(void) {
   if (!hiding)
     return;
 
-  if (jitter) {
+  if (jitter && hid_remotely) {
+    if (abs(moved_x) < jitter && abs(moved_y) < jitter)
+      return;
+  } else if (jitter) {
     if (!XQueryPointer(dpy, DefaultRootWindow(dpy), &win, &win, &cur_x, &cur_y,
                        &junk, &junk, &ujunk))
       return;
@@ -513,6 +1212,10 @@ static void show_cursor(void) {
   XFixesShowCursor(dpy, DefaultRootWindow(dpy));
   XFlush(dpy);
   hiding = 0;
+  refresh_inhibited();
+
+  if (power_save && !pointers_needed())
+    release_pointers();
 }
 
 static int test_bit(int bit, unsigned long *array) {
@@ -538,12 +1241,1096 @@ static int snoop_evdev(void) {
   return num_keyboards + num_mice;
 }
 
+/* Returns the number of device nodes added or removed */
+static int udev_receive(struct udev_monitor *mon) {
+  struct udev_device *dev;
+  const char *action, *path, *sysname;
+  int n = 0;
+
+  if (!(dev = udev_monitor_receive_device(mon)))
+    return 0;
+  action = udev_device_get_action(dev);
+  path = udev_device_get_devnode(dev);
+  sysname = udev_device_get_sysname(dev);
+  /* Inhibition is an attribute of the parent (inputN), so refresh all */
+  if (action && strcmp(action, "change") == 0) {
+    refresh_inhibited();
+    n++;
+  } else if (action && path && sysname && strncmp(sysname, "event", 5) == 0) {
+    /* Parents (inputN) and legacy mouseN/jsN nodes are not ours otherwise */
+    if (strcmp(action, "add") == 0) {
+      add_device(path);
+      n++;
+    } else if (strcmp(action, "remove") == 0) {
+      remove_device(path);
+      n++;
+    }
+  }
+  udev_device_unref(dev);
+  stats.hotplug_events += n;
+  return n;
+}
+
+/*
+ * Raw kernel uevent socket, used instead of libudev with -n.  A classic BPF
+ * filter drops everything but add/remove messages for event nodes and
+ * change messages for input devices in the kernel, so unrelated hotplug
+ * traffic never wakes us up.
+ */
+static int uevent_open(void) {
+  struct sock_filter code[14 + 3 * UEVENT_SCAN_LEN];
+  struct sock_fprog prog;
+  struct sockaddr_nl sa;
+  int fd, i, n = 0;
+
+  if ((fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                   NETLINK_KOBJECT_UEVENT)) < 0)
+    return -1;
+
+  /*
+   * Header is "add@/devices/...", "remove@/devices/..." or
+   * "change@/devices/...".  Leave what to look for in the devpath in X.
+   */
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0);
+  code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                           0x61646440 /* "add@" */, 7, 0);
+  code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                           0x72656d6f /* "remo" */, 0, 2);
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 4);
+  code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                           0x7665402f /* "ve@/" */, 4, 3);
+  code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                           0x6368616e /* "chan" */, 0, 2);
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 4);
+  code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                           0x6765402f /* "ge@/" */, 3, 0);
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+  /* Event nodes come and go; inhibition changes on their inputN parent */
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_LDX | BPF_W | BPF_IMM,
+                                           0x2f657665 /* "/eve" */);
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, 1);
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_LDX | BPF_W | BPF_IMM,
+                                           0x2f696e70 /* "/inp" */);
+
+  /*
+   * The devpath has no fixed layout, so look for X with an unrolled scan.
+   * Loads past the end of the packet make the kernel drop it, which is what
+   * we want for messages that never match.
+   */
+  for (i = 4; i < 4 + UEVENT_SCAN_LEN; i++) {
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, i);
+    code[n++] =
+        (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_X, 0, 0, 1);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+  }
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+  prog.len = n;
+  prog.filter = code;
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+    goto fail;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.nl_family = AF_NETLINK;
+  sa.nl_groups = 1; /* kernel broadcast group */
+  if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+    goto fail;
+  return fd;
+
+fail:
+  close(fd);
+  return -1;
+}
+
+static int uevent_receive(int fd) {
+  static char buf[UEVENT_BUFSIZE];
+  struct sockaddr_nl sa;
+  struct iovec iov = {buf, sizeof(buf) - 1};
+  struct msghdr msg;
+  const char *action, *subsystem, *devname, *p, *end;
+  char path[64];
+  ssize_t len;
+  int i, n = 0;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &sa;
+  msg.msg_namelen = sizeof(sa);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  while ((len = recvmsg(fd, &msg, 0)) > 0) {
+    /* Only trust the kernel, not other processes on the same group */
+    if (sa.nl_pid != 0)
+      continue;
+    buf[len] = '\0';
+    end = buf + len;
+
+    action = subsystem = devname = NULL;
+    for (p = buf + strlen(buf) + 1; p < end; p += strlen(p) + 1) {
+      if (strncmp(p, "ACTION=", 7) == 0)
+        action = p + 7;
+      else if (strncmp(p, "SUBSYSTEM=", 10) == 0)
+        subsystem = p + 10;
+      else if (strncmp(p, "DEVNAME=", 8) == 0)
+        devname = p + 8;
+    }
+    if (!action || !subsystem || strcmp(subsystem, "input") != 0)
+      continue;
+    if (strcmp(action, "change") == 0) {
+      refresh_inhibited();
+      n++;
+      continue;
+    }
+    if (!devname || strncmp(devname, "input/event", 11) != 0)
+      continue;
+    if (snprintf(path, sizeof(path), "/dev/%s", devname) >= (int)sizeof(path))
+      continue;
+
+    if (strcmp(action, "add") == 0) {
+      /* udev may not have applied group/ACL permissions yet */
+      if (access(path, R_OK) == 0)
+        add_device(path);
+      else if (num_pending < MAX_PENDING_DEVICES) {
+        DPRINTF(("deferring %s until udev is done with it\n", path));
+        strcpy(pending[num_pending].path, path);
+        pending[num_pending].tries = 0;
+        num_pending++;
+        timer_arm(TIMER_PENDING, PENDING_RETRY_MS);
+      }
+    } else if (strcmp(action, "remove") == 0) {
+      for (i = 0; i < num_pending; i++)
+        if (strcmp(pending[i].path, path) == 0)
+          pending[i--] = pending[--num_pending];
+      if (!num_pending)
+        timer_cancel(TIMER_PENDING);
+      remove_device(path);
+    } else
+      continue;
+    n++;
+  }
+  if (len < 0 && errno == ENOBUFS) {
+    /* Overflowed during a hotplug storm; pick up whatever we missed */
+    warnx("uevent socket overflow, rescanning /dev/input");
+    prune_devices();
+    snoop_evdev();
+    n++;
+  }
+  stats.hotplug_events += n;
+  return n;
+}
+
+static void retry_pending(void) {
+  int i;
+
+  for (i = 0; i < num_pending; i++) {
+    if (access(pending[i].path, R_OK) == 0)
+      add_device(pending[i].path);
+    else if (++pending[i].tries < PENDING_TRIES)
+      continue;
+    else
+      warnx("giving up on %s", pending[i].path);
+    pending[i--] = pending[--num_pending];
+  }
+  if (num_pending)
+    timer_arm(TIMER_PENDING, PENDING_RETRY_MS);
+}
+
+static void request_stats(int sig) { stats_requested = 1; }
+
+static void print_device(const char *class, struct input_device *d,
+                         uint64_t now) {
+  uint64_t suspended, active;
+  int i;
+
+  fprintf(stderr, "%s: %s", class, d->path);
+  /* Release runs up to a timer slack late */
+  if (d->quarantined)
+    fprintf(stderr, " (quarantined, %llus left)",
+            (unsigned long long)(now < d->quarantine_until
+                                     ? (d->quarantine_until - now) /
+                                           1000000000ULL
+                                     : 0));
+  if (d->quarantines)
+    fprintf(stderr, " (quarantined %u times)", d->quarantines);
+  if (power_save && d->fd < 0)
+    fprintf(stderr, " (released)");
+  if (d->dormant)
+    fprintf(stderr, " (%s)", d->inhibited ? "inhibited" : "inactive");
+  if (d->clock != CLOCK_MONOTONIC)
+    fprintf(stderr, " (realtime timestamps)");
+  if (d->power_dir && read_power_ms(d->power_dir, "runtime_suspended_time",
+                                    &suspended) == 0 &&
+      read_power_ms(d->power_dir, "runtime_active_time", &active) == 0 &&
+      suspended + active > d->suspended_base + d->active_base)
+    fprintf(stderr, " (autosuspended %.1f%%)",
+            100.0 * (suspended - d->suspended_base) /
+                (suspended + active - d->suspended_base - d->active_base));
+  fprintf(stderr, "\n");
+
+  if (!latency_mode || !d->latency_max_ns)
+    return;
+  fprintf(stderr, "  delivery latency: worst %.3fms during %s;",
+          d->latency_max_ns / 1e6,
+          d->latency_max_phase >= 0 ? phase_names[d->latency_max_phase]
+                                    : "(unknown)");
+  for (i = 0; i < LATENCY_BUCKETS - 1; i++)
+    if (d->latency_hist[i])
+      fprintf(stderr, " <%lluus: %lu", 1ULL << i, d->latency_hist[i]);
+  if (d->latency_hist[i])
+    fprintf(stderr, " more: %lu", d->latency_hist[i]);
+  fprintf(stderr, "\n");
+}
+
+/*
+ * Pointer events only matter while the cursor is hidden, to restart the
+ * idle timeout, or to reset the keystroke count for -c.  Otherwise, with -p,
+ * their nodes are closed so the devices behind them can runtime suspend.
+ */
+static int pointers_needed(void) {
+  return timeout || keystroke_count > 1 || (hiding && !always_hide);
+}
+
+static void release_pointers(void) {
+  int i;
+
+  for (i = 0; i < num_mice; i++) {
+    if (mice[i].fd < 0)
+      continue;
+    set_polled(&mice[i], 0);
+    close(mice[i].fd);
+    mice[i].fd = -1;
+  }
+}
+
+/* Classification is cached from add_device(), so this is just open(2) */
+static void reopen_pointers(void) {
+  uint64_t start, ns;
+  int i;
+
+  for (i = 0; i < num_mice; i++) {
+    if (mice[i].fd >= 0)
+      continue;
+    start = now_ns();
+    /* If it is gone, hotplug will tell us shortly */
+    if ((mice[i].fd = open(mice[i].path, O_RDONLY | O_NONBLOCK)) < 0)
+      continue;
+    set_clock(&mice[i]);
+    if (mice[i].quarantined || mice[i].dormant)
+      mask_device(&mice[i], 1);
+    ns = now_ns() - start;
+    stats.reopens++;
+    stats.reopen_ns += ns;
+    if (ns > stats.reopen_max_ns)
+      stats.reopen_max_ns = ns;
+  }
+}
+
+/*
+ * Find the power directory of the USB device an event node belongs to, and
+ * remember its runtime PM counters so residency is reported from now on.
+ */
+static void find_power_dir(struct input_device *d) {
+  char link[PATH_MAX], dir[PATH_MAX], file[PATH_MAX + 16], *p;
+  const char *name = strrchr(d->path, '/');
+  int depth;
+
+  if (!name)
+    return;
+  snprintf(link, sizeof(link), "/sys/class/input%s/device", name);
+  if (!realpath(link, dir))
+    return;
+  for (depth = 0; depth < USB_SEARCH_DEPTH; depth++) {
+    snprintf(file, sizeof(file), "%s/busnum", dir);
+    if (access(file, F_OK) == 0) {
+      snprintf(file, sizeof(file), "%s/power", dir);
+      if (read_power_ms(file, "runtime_suspended_time", &d->suspended_base) <
+              0 ||
+          read_power_ms(file, "runtime_active_time", &d->active_base) < 0)
+        return;
+      d->power_dir = strdup(file);
+      return;
+    }
+    if (!(p = strrchr(dir, '/')) || p == dir)
+      break;
+    *p = '\0';
+  }
+}
+
+static int read_power_ms(const char *dir, const char *attr, uint64_t *ms) {
+  char file[PATH_MAX + 32], buf[32];
+  ssize_t len;
+  int fd;
+
+  snprintf(file, sizeof(file), "%s/%s", dir, attr);
+  if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0)
+    return -1;
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return -1;
+  buf[len] = '\0';
+  *ms = strtoull(buf, NULL, 10);
+  return 0;
+}
+
+/* Time from the kernel stamping the event to the cursor being shown */
+static void note_unhide(struct input_device *d, struct input_event *ev) {
+  int64_t ns = event_age_ns(d, ev);
+  int polled = d->was_polled;
+
+  if (ns < 0)
+    return;
+  stats.unhides[polled]++;
+  stats.unhide_ns[polled] += ns;
+  if ((uint64_t)ns > stats.unhide_max_ns[polled])
+    stats.unhide_max_ns[polled] = ns;
+}
+
+/*
+ * Have the device stamp events with CLOCK_MONOTONIC, so their age is not
+ * thrown off by the wall clock being set.  It is a property of the open
+ * file, so this is repeated on every open.
+ */
+static void set_clock(struct input_device *d) {
+  int clock = CLOCK_MONOTONIC;
+
+  d->clock = ioctl(d->fd, EVIOCSCLOCKID, &clock) == 0 ? CLOCK_MONOTONIC
+                                                      : CLOCK_REALTIME;
+}
+
+static int64_t event_age_ns(struct input_device *d, struct input_event *ev) {
+  struct timespec ts;
+
+  clock_gettime(d->clock, &ts);
+  return (int64_t)(ts.tv_sec - ev->time.tv_sec) * 1000000000LL + ts.tv_nsec -
+         ev->time.tv_usec * 1000LL;
+}
+
+/*
+ * Every event goes into the histogram.  The first of a batch is the oldest,
+ * so it alone is checked against the worst so far and the -l threshold.
+ */
+static void note_latency(struct input_device *d, struct input_event *ev,
+                         int first) {
+  int64_t ns = event_age_ns(d, ev);
+  uint64_t us;
+  int bucket, p;
+
+  if (ns < 0)
+    ns = 0;
+  us = ns / 1000;
+  bucket = us ? 64 - __builtin_clzll(us) : 0;
+  if (bucket >= LATENCY_BUCKETS)
+    bucket = LATENCY_BUCKETS - 1;
+  d->latency_hist[bucket]++;
+  if (!first)
+    return;
+
+  p = phase_at(now_ns() - ns);
+  if ((uint64_t)ns > d->latency_max_ns) {
+    d->latency_max_ns = ns;
+    d->latency_max_phase = p;
+  }
+  if (latency_log_ns && (uint64_t)ns >= latency_log_ns)
+    warnx("%s: read %.3fms after the kernel stamped it, arrived during %s",
+          d->path, ns / 1e6, p >= 0 ? phase_names[p] : "(unknown)");
+}
+
+static void phase_mark(int p) {
+  if (p == phase)
+    return;
+  phase_log[phase_log_head % PHASE_LOG_LEN].when = now_ns();
+  phase_log[phase_log_head % PHASE_LOG_LEN].phase = p;
+  phase_log_head++;
+}
+
+/* The phase the loop was in at a given time, if the log reaches back */
+static int phase_at(uint64_t when) {
+  unsigned int i;
+
+  for (i = 1; i <= PHASE_LOG_LEN && i <= phase_log_head; i++)
+    if (phase_log[(phase_log_head - i) % PHASE_LOG_LEN].when <= when)
+      return phase_log[(phase_log_head - i) % PHASE_LOG_LEN].phase;
+  return -1;
+}
+
+static void drain_pointer(struct input_device *d) {
+  struct input_event ev;
+  unsigned int events = 0;
+  int was_hiding, moved = 0;
+  ssize_t len;
+
+  PHASE(PHASE_READ);
+  while ((len = read(d->fd, &ev, sizeof(ev))) == sizeof(ev)) {
+    stats.input_events++;
+    if (latency_mode)
+      note_latency(d, &ev, events == 0);
+    events++;
+    PHASE(PHASE_CLASSIFY);
+    track_motion(d, &ev);
+    track_event(d, &ev);
+    if (ev.type == EV_REL || ev.type == EV_ABS ||
+        (ev.type == EV_KEY && ev.value == 1)) {
+      stats.pointer_events++;
+      PHASE(PHASE_DECIDE);
+      if (always_hide)
+        ; /* nothing unhides */
+      else if (d->polled)
+        moved = 1;
+      else {
+        PHASE(PHASE_X);
+        was_hiding = hiding;
+        show_cursor();
+        if (was_hiding && !hiding) {
+          note_unhide(d, &ev);
+          d->was_polled = 0;
+        }
+      }
+    }
+    PHASE(PHASE_READ);
+  }
+
+  /* A polled pointer only matters to the idle alarm, once per batch */
+  if (moved) {
+    PHASE(PHASE_X);
+    show_cursor();
+  }
+
+  PHASE(PHASE_CLASSIFY);
+  check_gone(d, len);
+  if (d->fd >= 0) {
+    check_chatter(d, 0);
+    if (poll_rate && !d->quarantined)
+      update_polling(d, events);
+  }
+}
+
+/*
+ * With -r, a pointer reporting faster than the given rate while the cursor
+ * is shown stops waking us per report and is drained every POLL_INTERVAL_MS
+ * instead, like NAPI does for busy network interfaces.  It goes back to
+ * interrupt-style wakeups once it slows to a quarter of the rate, or as
+ * soon as the cursor is hidden.
+ */
+static void update_polling(struct input_device *d, unsigned int events) {
+  uint64_t now = now_ns(), elapsed = now - d->rate_start, rate;
+
+  d->rate_events += events;
+  if (elapsed < POLL_WINDOW_MS * 1000000ULL)
+    return;
+  rate = d->rate_events * 1000000000ULL / elapsed;
+  d->rate_start = now;
+  d->rate_events = 0;
+
+  if (!d->polled && !hiding && rate >= poll_rate)
+    set_polled(d, 1);
+  else if (d->polled && rate < poll_rate / 4)
+    set_polled(d, 0);
+}
+
+static void set_polled(struct input_device *d, int polled) {
+  if (d->polled == polled)
+    return;
+  DPRINTF(("%s %s\n", polled ? "polling" : "stopped polling", d->path));
+  d->polled = polled;
+  if (polled && num_polled++ == 0) {
+    polled_since = now_ns();
+    poll_arm();
+  } else if (!polled && --num_polled == 0) {
+    stats.poll_ns += now_ns() - polled_since;
+    timer_cancel(TIMER_POLL);
+  }
+}
+
+/*
+ * Timers run up to the slack after their deadline, and without other timers
+ * due it is all used, so take it off the interval.  A slack longer than the
+ * interval stretches it.
+ */
+static void poll_arm(void) {
+  uint64_t interval = POLL_INTERVAL_MS * 1000000ULL;
+
+  timer_program_at(TIMER_POLL,
+                   now_ns() + (interval > timer_slack ? interval - timer_slack
+                                                      : 0));
+}
+
+static void poll_pointers(void) {
+  int i;
+
+  for (i = 0; i < num_mice; i++) {
+    if (!mice[i].polled)
+      continue;
+    if (mice[i].fd < 0 || mice[i].quarantined || mice[i].dormant)
+      set_polled(&mice[i], 0);
+    else
+      drain_pointer(&mice[i]);
+  }
+  if (num_polled)
+    poll_arm();
+}
+
+/* Mirror the server's keymap; X keycodes are evdev codes plus 8 */
+static void track_key(struct input_event *ev) {
+  unsigned int keycode = ev->code + 8;
+
+  if (keycode >= sizeof(keys_down) * 8)
+    return;
+  if (ev->value)
+    keys_down[keycode >> 3] |= 1 << (keycode & 7);
+  else
+    keys_down[keycode >> 3] &= ~(1 << (keycode & 7));
+}
+
+/*
+ * Motion since the last hide, for -j without asking the server.  Relative
+ * deltas are unaccelerated and absolute ones are in device units, so this
+ * is only an approximation of the distance on screen.  Absolute positions
+ * are only compared within one touch, and not across a hide.
+ */
+static void track_motion(struct input_device *d, struct input_event *ev) {
+  int axis, delta;
+
+  if (ev->type == EV_KEY && ev->code == BTN_TOUCH && ev->value == 0) {
+    d->motion_has_last[0] = d->motion_has_last[1] = 0;
+    return;
+  }
+  if (ev->type == EV_REL && (ev->code == REL_X || ev->code == REL_Y)) {
+    axis = ev->code;
+    delta = ev->value;
+  } else if (ev->type == EV_ABS && (ev->code == ABS_X || ev->code == ABS_Y)) {
+    axis = ev->code;
+    delta = d->motion_has_last[axis] ? ev->value - d->motion_last[axis] : 0;
+    d->motion_last[axis] = ev->value;
+    d->motion_has_last[axis] = 1;
+  } else
+    return;
+  if (axis == REL_X)
+    moved_x += delta;
+  else
+    moved_y += delta;
+}
+
+/*
+ * Time a few empty round trips and keep the fastest, then decide whether
+ * replies are too slow to wait for.  Remote mode has hysteresis so a
+ * server that is slow now and then does not flip it back and forth.
+ */
+static void measure_rtt(void) {
+  uint64_t start, ns, rtt = 0, limit = rtt_threshold * 1000000ULL;
+  int i;
+
+  for (i = 0; i < RTT_SAMPLES; i++) {
+    start = now_ns();
+    XSync(dpy, False);
+    ns = now_ns() - start;
+    if (i == 0 || ns < rtt)
+      rtt = ns;
+  }
+
+  stats.rtt_ns = rtt;
+  if (stats.rtt_samples++ == 0 || rtt < stats.rtt_min_ns)
+    stats.rtt_min_ns = rtt;
+  if (rtt > stats.rtt_max_ns)
+    stats.rtt_max_ns = rtt;
+
+  if (rtt_threshold && !remote && rtt >= limit) {
+    DPRINTF(("round trip %.3fms, not waiting for replies\n", rtt / 1e6));
+    remote = 1;
+  } else if (remote && (!rtt_threshold || rtt < limit / 2)) {
+    DPRINTF(("round trip %.3fms, waiting for replies again\n", rtt / 1e6));
+    remote = 0;
+  }
+  timer_arm(TIMER_RTT, RTT_INTERVAL_MS);
+}
+
+/*
+ * Built-in keyboards and touchpads are switched off by the lid, and all but
+ * touchscreens by tablet mode.  Whatever sits behind the i8042 controller,
+ * I2C, SPI or a platform driver is taken to be built in.
+ */
+static void probe_dormancy(struct input_device *d) {
+  unsigned long prop_bits[INPUT_PROP_MAX / (sizeof(long) * 8) + 1];
+  struct input_id id;
+
+  if (ioctl(d->fd, EVIOCGID, &id) == 0)
+    d->internal = id.bustype == BUS_I8042 || id.bustype == BUS_I2C ||
+                  id.bustype == BUS_SPI || id.bustype == BUS_HOST;
+  memset(prop_bits, 0, sizeof(prop_bits));
+  if (ioctl(d->fd, EVIOCGPROP(sizeof(prop_bits)), prop_bits) >= 0)
+    d->direct = test_bit(INPUT_PROP_DIRECT, prop_bits);
+  d->inhibited = read_inhibited(d);
+  update_dormant(d);
+}
+
+static int read_inhibited(struct input_device *d) {
+  const char *name = strrchr(d->path, '/');
+  char file[PATH_MAX], buf[4];
+  ssize_t len;
+  int fd;
+
+  if (!name)
+    return 0;
+  snprintf(file, sizeof(file), "/sys/class/input%s/device/inhibited", name);
+  /* Kernels before 5.11 can't inhibit devices */
+  if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0)
+    return 0;
+  len = read(fd, buf, sizeof(buf));
+  close(fd);
+  return len > 0 && buf[0] == '1';
+}
+
+/* Dormant devices are masked and left out of select() like quarantined ones */
+static void update_dormant(struct input_device *d) {
+  int dormant = d->inhibited ||
+                (d->internal && (lid_closed || (tablet_mode && !d->direct)));
+
+  if (dormant == d->dormant)
+    return;
+  DPRINTF(("%s %s\n", dormant ? "ignoring inactive" : "resuming", d->path));
+  d->dormant = dormant;
+  if (dormant)
+    set_polled(d, 0);
+  /* Unmasking discards the backlog where masks are unsupported */
+  if (d->fd >= 0 && !d->quarantined)
+    mask_device(d, dormant);
+  if (!dormant) {
+    d->window_start = now_ns();
+    d->window_events = d->window_meaningful = 0;
+  }
+}
+
+static void update_all_dormant(void) {
+  int i;
+
+  for (i = 0; i < num_keyboards; i++)
+    update_dormant(&keyboards[i]);
+  for (i = 0; i < num_mice; i++)
+    update_dormant(&mice[i]);
+}
+
+static void refresh_inhibited(void) {
+  int i;
+
+  for (i = 0; i < num_keyboards; i++)
+    keyboards[i].inhibited = read_inhibited(&keyboards[i]);
+  for (i = 0; i < num_mice; i++)
+    mice[i].inhibited = read_inhibited(&mice[i]);
+  update_all_dormant();
+}
+
+static void drain_switch(struct input_device *d) {
+  struct input_event ev;
+  int batch = 0;
+  ssize_t len;
+
+  PHASE(PHASE_READ);
+  while ((len = read(d->fd, &ev, sizeof(ev))) == sizeof(ev)) {
+    stats.input_events++;
+    if (latency_mode)
+      note_latency(d, &ev, batch++ == 0);
+    if (ev.type != EV_SW ||
+        (ev.code != SW_LID && ev.code != SW_TABLET_MODE))
+      continue;
+    if (ev.value)
+      d->switch_state |= 1 << ev.code;
+    else
+      d->switch_state &= ~(1 << ev.code);
+  }
+  PHASE(PHASE_CLASSIFY);
+  check_gone(d, len);
+  update_switches();
+}
+
+/* Any switch device reporting the lid closed or tablet mode is believed */
+static void update_switches(void) {
+  unsigned int state = 0;
+  int i;
+
+  for (i = 0; i < num_switches; i++)
+    state |= switches[i].switch_state;
+  if (!!(state & 1 << SW_LID) == lid_closed &&
+      !!(state & 1 << SW_TABLET_MODE) == tablet_mode)
+    return;
+  lid_closed = !!(state & 1 << SW_LID);
+  tablet_mode = !!(state & 1 << SW_TABLET_MODE);
+  DPRINTF(("lid %s, tablet mode %s\n", lid_closed ? "closed" : "open",
+           tablet_mode ? "on" : "off"));
+  update_all_dormant();
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void timer_arm(int id, unsigned int ms) {
+  timer_program_at(id, now_ns() + ms * 1000000ULL);
+}
+
+/* Arm for an absolute deadline, unless an earlier one is already set */
+static void timer_program_at(int id, uint64_t when) {
+  if (timers[id].when == 0 || when < timers[id].when)
+    timers[id].when = when;
+  timer_program();
+}
+
+static void timer_cancel(int id) {
+  timers[id].when = 0;
+  timer_program();
+}
+
+/*
+ * Sleep until the earliest point at which some timer's slack runs out; all
+ * timers whose deadline has passed by then are run together.
+ */
+static void timer_program(void) {
+  struct itimerspec its;
+  uint64_t wake = 0;
+  int i;
+
+  for (i = 0; i < NUM_TIMERS; i++)
+    if (timers[i].when &&
+        (wake == 0 || timers[i].when + timer_slack < wake))
+      wake = timers[i].when + timer_slack;
+
+  if (wake == timer_programmed)
+    return;
+  timer_programmed = wake;
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = wake / 1000000000ULL;
+  its.it_value.tv_nsec = wake % 1000000000ULL;
+  if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+    warn("timerfd_settime");
+}
+
+static void timer_run(void) {
+  uint64_t expirations, now;
+  int i;
+
+  if (read(timer_fd, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN)
+    warn("timerfd read");
+
+  timer_programmed = 0;
+  now = now_ns();
+  for (i = 0; i < NUM_TIMERS; i++) {
+    if (timers[i].when && timers[i].when <= now) {
+      timers[i].when = 0;
+      timers[i].fn();
+    }
+  }
+  timer_program();
+}
+
+static void print_stats(void) {
+  uint64_t now = now_ns(), poll_ns;
+  int i;
+
+  fprintf(stderr,
+          "wakeups: %lu, input events: %lu, key presses: %lu, "
+          "pointer events: %lu\n",
+          stats.wakeups, stats.input_events, stats.key_events,
+          stats.pointer_events);
+  fprintf(stderr, "hotplug (%s): %lu wakeups, %lu device events\n",
+          use_netlink ? "netlink" : "udev", stats.hotplug_wakeups,
+          stats.hotplug_events);
+  fprintf(stderr, "quarantines: %lu\n", stats.quarantines);
+  for (i = 0; i < 2; i++)
+    if (stats.unhides[i])
+      fprintf(stderr, "unhide latency%s: avg %.3fms, max %.3fms over %lu\n",
+              i ? " after polling" : "",
+              stats.unhide_ns[i] / 1e6 / stats.unhides[i],
+              stats.unhide_max_ns[i] / 1e6, stats.unhides[i]);
+  if (poll_rate) {
+    poll_ns = stats.poll_ns + (num_polled ? now - polled_since : 0);
+    fprintf(stderr,
+            "wakeups/s: %.1f interrupt-driven, %.1f polled "
+            "(%.1fs of %.1fs polled)\n",
+            now - start_time > poll_ns
+                ? (stats.wakeups - stats.poll_wakeups) * 1e9 /
+                      (now - start_time - poll_ns)
+                : 0,
+            poll_ns ? stats.poll_wakeups * 1e9 / poll_ns : 0, poll_ns / 1e9,
+            (now - start_time) / 1e9);
+  }
+  fprintf(stderr,
+          "X round trip: %.3fms (min %.3fms, max %.3fms over %lu)%s\n",
+          stats.rtt_ns / 1e6, stats.rtt_min_ns / 1e6, stats.rtt_max_ns / 1e6,
+          stats.rtt_samples, remote ? ", not waiting for replies" : "");
+  if (stats.reopens)
+    fprintf(stderr, "pointer reopens: %lu, avg %.3fms, max %.3fms\n",
+            stats.reopens, stats.reopen_ns / 1e6 / stats.reopens,
+            stats.reopen_max_ns / 1e6);
+  for (i = 0; i < num_keyboards; i++)
+    print_device("keyboard", &keyboards[i], now);
+  for (i = 0; i < num_mice; i++)
+    print_device("pointer", &mice[i], now);
+  for (i = 0; i < num_switches; i++)
+    print_device("switch", &switches[i], now);
+  if (num_switches)
+    fprintf(stderr, "lid %s, tablet mode %s\n", lid_closed ? "closed" : "open",
+            tablet_mode ? "on" : "off");
+  if (energy_mode)
+    print_energy();
+}
+
+static void energy_init(void) {
+  char path[PATH_MAX], buf[32];
+  ssize_t len;
+  int i, fd;
+
+  /* Top-level RAPL zones are the packages; subzones would double count */
+  for (i = 0; i < MAX_RAPL_ZONES; i++) {
+    snprintf(path, sizeof(path),
+             "/sys/class/powercap/intel-rapl:%d/max_energy_range_uj", i);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+      break;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+      break;
+    buf[len] = '\0';
+    rapl_range[num_rapl] = strtoull(buf, NULL, 10);
+
+    snprintf(path, sizeof(path), "/sys/class/powercap/intel-rapl:%d/energy_uj",
+             i);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+      warn("can't open %s, energy will not be reported", path);
+      break;
+    }
+    rapl_fds[num_rapl++] = fd;
+  }
+
+  if ((schedstat_fd = open("/proc/self/schedstat", O_RDONLY | O_CLOEXEC)) < 0)
+    warn("can't open /proc/self/schedstat");
+
+  energy_read(&energy_last);
+  timer_arm(TIMER_ENERGY, ENERGY_INTERVAL_MS);
+}
+
+static void energy_read(struct energy_sample *s) {
+  struct rusage ru;
+  unsigned long long a = 0, b = 0, c = 0;
+  uint64_t cur;
+  char buf[96];
+  ssize_t len;
+  int i;
+
+  memset(s, 0, sizeof(*s));
+  s->energy_uj = energy_last.energy_uj;
+  for (i = 0; i < num_rapl; i++) {
+    if ((len = pread(rapl_fds[i], buf, sizeof(buf) - 1, 0)) <= 0)
+      continue;
+    buf[len] = '\0';
+    cur = strtoull(buf, NULL, 10);
+    /* The counters wrap at max_energy_range_uj */
+    s->energy_uj += cur >= rapl_last[i] ? cur - rapl_last[i]
+                                        : cur + rapl_range[i] - rapl_last[i];
+    rapl_last[i] = cur;
+  }
+
+  if (schedstat_fd >= 0 &&
+      (len = pread(schedstat_fd, buf, sizeof(buf) - 1, 0)) > 0) {
+    buf[len] = '\0';
+    sscanf(buf, "%llu %llu %llu", &a, &b, &c);
+  }
+  s->cpu_ns = a;
+  s->wait_ns = b;
+  s->slices = c;
+
+  getrusage(RUSAGE_SELF, &ru);
+  s->nvcsw = ru.ru_nvcsw;
+  s->nivcsw = ru.ru_nivcsw;
+  s->wakeups = stats.wakeups;
+  s->key_events = stats.key_events;
+  s->pointer_events = stats.pointer_events;
+}
+
+static void energy_tick(void) {
+  struct energy_sample cur, *sum;
+  uint64_t keys, pointer;
+  int load;
+
+  energy_read(&cur);
+  keys = cur.key_events - energy_last.key_events;
+  pointer = cur.pointer_events - energy_last.pointer_events;
+  if (keys == 0 && pointer == 0)
+    load = LOAD_IDLE;
+  else
+    load = keys >= pointer ? LOAD_TYPING : LOAD_POINTING;
+
+  energy_loads[load].intervals++;
+  sum = &energy_loads[load].sum;
+  sum->energy_uj += cur.energy_uj - energy_last.energy_uj;
+  sum->cpu_ns += cur.cpu_ns - energy_last.cpu_ns;
+  sum->wait_ns += cur.wait_ns - energy_last.wait_ns;
+  sum->slices += cur.slices - energy_last.slices;
+  sum->nvcsw += cur.nvcsw - energy_last.nvcsw;
+  sum->nivcsw += cur.nivcsw - energy_last.nivcsw;
+  sum->wakeups += cur.wakeups - energy_last.wakeups;
+  sum->key_events += keys;
+  sum->pointer_events += pointer;
+  energy_last = cur;
+
+  timer_arm(TIMER_ENERGY, ENERGY_INTERVAL_MS);
+}
+
+static void print_energy(void) {
+  struct energy_sample *sum;
+  double secs;
+  int i;
+
+  for (i = 0; i < NUM_LOADS; i++) {
+    if (!energy_loads[i].intervals)
+      continue;
+    sum = &energy_loads[i].sum;
+    secs = energy_loads[i].intervals * ENERGY_INTERVAL_MS / 1000.0;
+    fprintf(stderr,
+            "energy %s: %.0fs, cpu %.3fms (%.3fms/s), runqueue wait %.3fms, "
+            "%llu slices, %llu+%llu ctx switches, %llu wakeups (%.1f/s)",
+            load_names[i], secs, sum->cpu_ns / 1e6, sum->cpu_ns / 1e6 / secs,
+            sum->wait_ns / 1e6, (unsigned long long)sum->slices,
+            (unsigned long long)sum->nvcsw, (unsigned long long)sum->nivcsw,
+            (unsigned long long)sum->wakeups, sum->wakeups / secs);
+    if (num_rapl)
+      fprintf(stderr, ", package %.3fJ (%.3fW)", sum->energy_uj / 1e6,
+              sum->energy_uj / 1e6 / secs);
+    fprintf(stderr, "\n");
+  }
+}
+
+static int perf_open(uint64_t config, int group) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.disabled = group < 0;
+  attr.exclude_kernel = perf_exclude_kernel;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group,
+                 PERF_FLAG_FD_CLOEXEC);
+}
+
+static void profile_init(void) {
+  int i, fds[NUM_COUNTERS];
+
+  /* Syscalls are a large part of our cost, but may not be countable */
+  if ((perf_fd = perf_open(perf_configs[0], -1)) < 0 &&
+      (errno == EACCES || errno == EPERM)) {
+    perf_exclude_kernel = 1;
+    perf_fd = perf_open(perf_configs[0], -1);
+  }
+  if (perf_fd < 0) {
+    warn("can't open performance counters, profiling disabled");
+    return;
+  }
+  /* Siblings stay open for as long as the group is read */
+  for (i = 1; i < NUM_COUNTERS; i++) {
+    if ((fds[i] = perf_open(perf_configs[i], perf_fd)) < 0) {
+      warn("can't open performance counter %d, profiling disabled", i);
+      while (--i > 0)
+        close(fds[i]);
+      close(perf_fd);
+      perf_fd = -1;
+      return;
+    }
+  }
+  if (perf_exclude_kernel)
+    warnx("profiling user space only (see perf_event_paranoid)");
+
+  ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  profile_calibrate();
+  profile_phase();
+  timer_arm(TIMER_PROFILE, PROFILE_INTERVAL_MS);
+}
+
+/*
+ * Every phase boundary is a read() of the group, and the counters see that
+ * read as part of the span.  Time back-to-back reads to learn what one
+ * costs, so that profile_phase() can take it off again.
+ */
+static void profile_calibrate(void) {
+  uint64_t first[1 + NUM_COUNTERS], buf[1 + NUM_COUNTERS];
+  int i;
+
+  if (read(perf_fd, first, sizeof(first)) != sizeof(first))
+    return;
+  for (i = 0; i < PROFILE_CALIBRATE_READS; i++)
+    if (read(perf_fd, buf, sizeof(buf)) != sizeof(buf))
+      return;
+  for (i = 0; i < NUM_COUNTERS; i++)
+    perf_read_cost[i] =
+        (buf[1 + i] - first[1 + i]) / PROFILE_CALIBRATE_READS;
+  DPRINTF(("profile: a counter read costs %llu cycles, %llu insns\n",
+           (unsigned long long)perf_read_cost[CTR_CYCLES],
+           (unsigned long long)perf_read_cost[CTR_INSTRUCTIONS]));
+}
+
+/*
+ * Charge everything since the last boundary to the phase we are leaving,
+ * less the cost of the read that measured it.
+ */
+static void profile_phase(void) {
+  uint64_t buf[1 + NUM_COUNTERS], delta;
+  int i;
+
+  if (read(perf_fd, buf, sizeof(buf)) != sizeof(buf))
+    return;
+  for (i = 0; i < NUM_COUNTERS; i++) {
+    delta = buf[1 + i] - perf_last[i];
+    perf_phases[phase][i] +=
+        delta > perf_read_cost[i] ? delta - perf_read_cost[i] : 0;
+    perf_last[i] = buf[1 + i];
+  }
+}
+
+static void profile_tick(void) {
+  unsigned long events = stats.input_events - perf_events_base;
+  unsigned long wakeups = stats.wakeups - perf_wakeups_base;
+  double div = events ? events : 1;
+  uint64_t *c;
+  int i;
+
+  profile_phase();
+  fprintf(stderr, "profile: %lu events, %lu wakeups in %ds%s\n", events,
+          wakeups, PROFILE_INTERVAL_MS / 1000,
+          perf_exclude_kernel ? " (user space only)" : "");
+  for (i = 0; i < NUM_PHASES; i++) {
+    c = perf_phases[i];
+    if (c[CTR_CYCLES] == 0)
+      continue;
+    fprintf(stderr,
+            "  %-8s %10.0f cycles/ev %10.0f insns/ev  ipc %.2f  "
+            "%8.1f cache-misses/ev %8.1f branch-misses/ev\n",
+            phase_names[i], c[CTR_CYCLES] / div, c[CTR_INSTRUCTIONS] / div,
+            (double)c[CTR_INSTRUCTIONS] / c[CTR_CYCLES],
+            c[CTR_CACHE_MISSES] / div, c[CTR_BRANCH_MISSES] / div);
+  }
+
+  memset(perf_phases, 0, sizeof(perf_phases));
+  perf_events_base = stats.input_events;
+  perf_wakeups_base = stats.wakeups;
+  timer_arm(TIMER_PROFILE, PROFILE_INTERVAL_MS);
+}
+
+/*
+ * The trigger is relative to the idle time when the server creates the
+ * alarm, which is right after the input that brought us here, so an alarm
+ * that has not fired yet is still good.  Remotely, it is left alone.
+ */
 static void set_alarm(XSyncAlarm *alarm, XSyncTestType test) {
   XSyncAlarmAttributes attr;
-  XSyncValue value;
   unsigned int flags;
 
-  XSyncQueryCounter(dpy, idler_counter, &value);
+  if (remote && alarm_armed)
+    return;
   attr.trigger.counter = idler_counter;
   attr.trigger.test_type = test;
   attr.trigger.value_type = XSyncRelative;
@@ -556,12 +2343,14 @@ static void set_alarm(XSyncAlarm *alarm, XSyncTestType test) {
   if (*alarm)
     XSyncDestroyAlarm(dpy, *alarm);
   *alarm = XSyncCreateAlarm(dpy, flags, &attr);
+  alarm_armed = 1;
 }
 
 static void usage(char *progname) {
   fprintf(stderr,
-          "usage: %s [-a] [-c count] [-d] [-i mod] [-j pixels] "
-          "[-m [w]nw|ne|sw|se|+/-xy] [-t seconds] [-s]\n",
+          "usage: %s [-a] [-c count] [-d] [-e] [-i mod] [-j pixels] [-l msecs] "
+          "[-m [w]nw|ne|sw|se|+/-xy] [-n] [-p] [-P] [-q rate] [-r rate] "
+          "[-R msecs] [-t seconds] [-s] [-w msecs]\n",
           progname);
   exit(1);
 }
@@ -0,0 +1,212 @@
+#!/bin/sh
+#
+# bbcompare.sh - run the same input workloads against betterbanish and any
+# other cursor hiding daemons installed, and report their cost side by side.
+#
+# Workloads are generated live through uinput by bbgen.  Xvfb never sees
+# uinput devices, so a real Xorg is started with the dummy video driver and
+# the libinput input driver, and it picks the devices up through udev like
+# any others; the real devices are ignored.  bbshim is preloaded into every
+# daemon to timestamp its hide/show calls and count its X requests, so
+# competitors need no changes.  A daemon that never hid or showed the
+# cursor during a workload with events did not see the input, and fails
+# the run.  Needs Xorg with xf86-video-dummy and xf86-input-libinput, udev,
+# write access to /dev/uinput and read access to /dev/input (in practice,
+# root).
+#
+# Environment:
+#   DURATION      seconds per workload (default 20)
+#   WORKLOADS     subset of "typing motion touchpad hotplug"
+#   BB_ARGS, XBANISH_ARGS, UNCLUTTER_ARGS
+#                 extra arguments for each daemon, to compare like with like
+
+set -u
+
+tools=$(cd "$(dirname "$0")" && pwd)
+top=$(dirname "$tools")
+bbgen=$tools/bbgen
+shim=$tools/bbshim.so
+display=${DISPLAY_NUM:-:97}
+duration=${DURATION:-20}
+workloads=${WORKLOADS:-"typing motion touchpad hotplug"}
+hz=$(getconf CLK_TCK)
+tmp=$(mktemp -d)
+
+for f in "$bbgen" "$shim"; do
+	if [ ! -e "$f" ]; then
+		echo "$f missing, run 'make tools' first" >&2
+		exit 1
+	fi
+done
+if ! command -v Xorg >/dev/null; then
+	echo "Xorg not found" >&2
+	exit 1
+fi
+
+daemons=""
+if [ -x "$top/betterbanish" ]; then
+	daemons="$daemons betterbanish"
+else
+	echo "skipping betterbanish: not built" >&2
+fi
+if command -v xbanish >/dev/null; then
+	daemons="$daemons xbanish"
+else
+	echo "skipping xbanish: not installed" >&2
+fi
+if command -v unclutter >/dev/null &&
+    unclutter --help 2>&1 | grep -q -- --ignore-scrolling; then
+	daemons="$daemons unclutter-xfixes"
+else
+	echo "skipping unclutter-xfixes: not installed" >&2
+fi
+
+# Only bbgen's devices are enabled, through libinput like on a desktop
+cat >"$tmp/xorg.conf" <<EOF
+Section "ServerFlags"
+	Option "AutoAddDevices" "on"
+	Option "AutoEnableDevices" "on"
+EndSection
+Section "Device"
+	Identifier "dummy"
+	Driver "dummy"
+	VideoRam 16384
+EndSection
+Section "Monitor"
+	Identifier "monitor"
+	HorizSync 5.0 - 1000.0
+	VertRefresh 5.0 - 200.0
+	Modeline "1280x800" 83.46 1280 1344 1480 1680 800 801 804 828
+EndSection
+Section "Screen"
+	Identifier "screen"
+	Device "dummy"
+	Monitor "monitor"
+	DefaultDepth 24
+	SubSection "Display"
+		Depth 24
+		Modes "1280x800"
+	EndSubSection
+EndSection
+Section "InputClass"
+	Identifier "other devices"
+	MatchDevicePath "/dev/input/event*"
+	Option "Ignore" "on"
+EndSection
+Section "InputClass"
+	Identifier "bbgen devices"
+	MatchProduct "bbgen"
+	MatchDevicePath "/dev/input/event*"
+	Driver "libinput"
+	Option "Ignore" "off"
+EndSection
+EOF
+mkdir "$tmp/xorg.conf.d"
+
+Xorg "$display" -config "$tmp/xorg.conf" -configdir "$tmp/xorg.conf.d" \
+    -logfile "$tmp/Xorg.log" -nolisten tcp -noreset -novtswitch -sharevts \
+    >/dev/null 2>&1 &
+xorg=$!
+trap 'kill $xorg 2>/dev/null; rm -rf "$tmp"' EXIT INT TERM
+sleep 2
+if ! kill -0 $xorg 2>/dev/null; then
+	echo "Xorg failed to start; are the dummy and libinput drivers" \
+	    "installed?" >&2
+	exit 1
+fi
+
+daemon_cmd() {
+	case $1 in
+	betterbanish) echo "$top/betterbanish ${BB_ARGS:-}" ;;
+	xbanish) echo "xbanish ${XBANISH_ARGS:-}" ;;
+	unclutter-xfixes) echo "unclutter ${UNCLUTTER_ARGS:-}" ;;
+	esac
+}
+
+run_workload() {
+	case $1 in
+	typing)
+		"$bbgen" -u -d "$duration" -m 1:0:0:0:0 -l "$tmp/inject" ;;
+	motion)
+		"$bbgen" -u -d "$duration" -r 8000 -m 1:4:1:0:0 -l "$tmp/inject" ;;
+	touchpad)
+		"$bbgen" -u -d "$duration" -t 1 -p 0 -m 1:0:0:4:0 \
+		    -l "$tmp/inject" ;;
+	hotplug)
+		# 16 devices appearing and disappearing together, back to back
+		"$bbgen" -H $((duration * 5)) -k 8 -p 8 ;;
+	esac
+}
+
+# utime+stime in ticks, then voluntary context switches (wakeups)
+sample() {
+	awk '{ print $14 + $15 }' "/proc/$1/stat"
+	awk '/^voluntary_ctxt_switches/ { print $2 }' "/proc/$1/status"
+}
+
+# Pair each hide with the first key press since the last show, and each show
+# with the first pointer event since the last hide.
+latency() {
+	sort -n -k1,1 "$tmp/inject" "$tmp/shim" | awk '
+	$2 == "key" && !hidden && !k { k = $1 }
+	$2 == "pointer" && hidden && !p { p = $1 }
+	$2 == "hide" {
+		if (k) { h += $1 - k; hn++; if ($1 - k > hm) hm = $1 - k }
+		hidden = 1; k = p = 0
+	}
+	$2 == "show" {
+		if (p) { s += $1 - p; sn++; if ($1 - p > sm) sm = $1 - p }
+		hidden = 0; k = p = 0
+	}
+	$2 == "requests" { if (r0 == "") r0 = $3; r1 = $3 }
+	END {
+		printf "%8d  ", r1 - r0
+		if (hn) printf "%7.2f/%-7.2f  ", h / hn / 1e6, hm / 1e6
+		else printf "%15s  ", "-"
+		if (sn) printf "%7.2f/%-7.2f\n", s / sn / 1e6, sm / 1e6
+		else printf "%15s\n", "-"
+	}'
+}
+
+failed=0
+printf "%-9s %-17s %8s %8s %8s  %-15s  %-15s\n" workload daemon "cpu ms" \
+    wakeups "X reqs" "hide ms avg/max" "show ms avg/max"
+for w in $workloads; do
+	for d in $daemons; do
+		: >"$tmp/inject"
+		: >"$tmp/shim"
+		DISPLAY=$display BBSHIM_LOG=$tmp/shim LD_PRELOAD=$shim \
+		    $(daemon_cmd "$d") >/dev/null 2>&1 &
+		pid=$!
+		sleep 1
+		if ! kill -0 $pid 2>/dev/null; then
+			echo "$d failed to start" >&2
+			continue
+		fi
+
+		kill -USR2 $pid
+		set -- $(sample $pid)
+		run_workload "$w" >/dev/null 2>&1
+		sleep 0.5
+		kill -USR2 $pid
+		sleep 0.2
+		set -- "$@" $(sample $pid)
+		kill $pid
+		wait $pid 2>/dev/null
+
+		awk -v w="$w" -v d="$d" -v hz="$hz" -v cpu=$(($3 - $1)) \
+		    -v wakeups=$(($4 - $2)) 'BEGIN {
+			printf "%-9s %-17s %8.1f %8d ", w, d, cpu * 1000 / hz,
+			    wakeups
+		}'
+		latency
+
+		if [ "$w" != hotplug ] &&
+		    ! grep -q -e ' hide ' -e ' show ' "$tmp/shim"; then
+			echo "$d never hid or showed the cursor during $w:" \
+			    "it saw no input" >&2
+			failed=1
+		fi
+	done
+done
+exit $failed
@@ -0,0 +1,736 @@
+/*
+ * bbgen.c - synthetic input workload generator for betterbanish
+ *
+ * Produces evdev event streams from simple statistical models of typing,
+ * pointing, scrolling and touchpad use, and either writes them out as a
+ * trace or plays them back live through uinput devices.
+ *
+ * Trace format, one record per line:
+ *
+ *   # comment
+ *   device <id> keyboard|pointer|touchpad <name>
+ *   <sec>.<usec> <id> <type> <code> <value>
+ *
+ * Event lines are sorted by time and refer to previously declared devices.
+ *
+ * When playing live, -l logs the CLOCK_MONOTONIC time at which every key
+ * press and pointer event was injected, for measuring reaction latency.
+ * With -H, no events are sent; the devices are created and destroyed
+ * together, back to back, for the given number of cycles.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DEVICES 32
+#define USEC 1000000ULL
+#define TP_MAX_X 4000
+#define TP_MAX_Y 2500
+#define TP_RES 40 /* units per mm */
+#define TP_PALM_SLOT 2 /* fingers use slots 0 and 1 */
+
+enum dev_class { DEV_KEYBOARD, DEV_POINTER, DEV_TOUCHPAD, NUM_CLASSES };
+enum activity { ACT_TYPING, ACT_POINTING, ACT_SCROLL, ACT_TOUCHPAD, ACT_IDLE,
+                NUM_ACTIVITIES };
+
+struct event {
+  uint64_t t; /* usec from start */
+  uint32_t seq;
+  uint16_t dev;
+  uint16_t type, code;
+  int32_t value;
+};
+
+struct device {
+  int class;
+  char name[64];
+  int fd;
+};
+
+static void usage(char *);
+static void seed_rng(uint64_t);
+static double urand(void);
+static double nrand(void);
+static double lognrand(double, double);
+static double exprand(double);
+static double minjerk(double);
+static int add_gen_device(int);
+static int pick_device(int);
+static void emit(int, uint64_t, int, int, int);
+static void syn(int, uint64_t);
+static void key(int, uint64_t, uint64_t, int);
+static uint64_t gen_typing(uint64_t);
+static uint64_t gen_pointing(uint64_t);
+static uint64_t gen_scroll(uint64_t);
+static uint64_t gen_touchpad(uint64_t);
+static void gen_palm(int, uint64_t);
+static void generate(uint64_t);
+static int cmp_event(const void *, const void *);
+static void write_trace(FILE *);
+static void read_trace(FILE *);
+static int uinput_create(struct device *);
+static void play_live(FILE *);
+static void play_hotplug(int);
+
+static const char *class_names[NUM_CLASSES] = {"keyboard", "pointer",
+                                               "touchpad"};
+
+static struct device devices[MAX_DEVICES];
+static int num_devices = 0;
+
+static struct event *events = NULL;
+static size_t num_events = 0, max_events = 0;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+static int poll_hz = 1000, tp_hz = 125;
+static double wpm = 60, burst_words = 8, chord_prob = 0.05, palm_rate = 4;
+static double mix[NUM_ACTIVITIES] = {4, 3, 1, 2, 2};
+static int tracking_id = 0;
+
+static const int letters[] = {
+    KEY_E, KEY_T, KEY_A, KEY_O, KEY_I, KEY_N, KEY_S, KEY_H, KEY_R,
+    KEY_D, KEY_L, KEY_C, KEY_U, KEY_M, KEY_W, KEY_F, KEY_G, KEY_Y,
+    KEY_P, KEY_B, KEY_V, KEY_K, KEY_J, KEY_X, KEY_Q, KEY_Z,
+};
+
+int main(int argc, char *argv[]) {
+  int ch, i, live = 0, cycles = 0, nclass[NUM_CLASSES] = {1, 1, 0};
+  double duration = 60;
+  char *out = NULL, *replay = NULL, *log = NULL;
+  FILE *f, *logf = NULL;
+
+  while ((ch = getopt(argc, argv, "b:c:d:H:k:l:m:o:p:P:r:R:s:t:T:uW:")) != -1)
+    switch (ch) {
+    case 'b':
+      burst_words = strtod(optarg, NULL);
+      break;
+    case 'c':
+      chord_prob = strtod(optarg, NULL);
+      break;
+    case 'd':
+      duration = strtod(optarg, NULL);
+      break;
+    case 'H':
+      cycles = strtoul(optarg, NULL, 0);
+      break;
+    case 'k':
+      nclass[DEV_KEYBOARD] = strtoul(optarg, NULL, 0);
+      break;
+    case 'l':
+      log = optarg;
+      break;
+    case 'm':
+      if (sscanf(optarg, "%lf:%lf:%lf:%lf:%lf", &mix[ACT_TYPING],
+                 &mix[ACT_POINTING], &mix[ACT_SCROLL], &mix[ACT_TOUCHPAD],
+                 &mix[ACT_IDLE]) != NUM_ACTIVITIES) {
+        warnx("invalid '-m' argument");
+        usage(argv[0]);
+      }
+      break;
+    case 'o':
+      out = optarg;
+      break;
+    case 'p':
+      nclass[DEV_POINTER] = strtoul(optarg, NULL, 0);
+      break;
+    case 'P':
+      palm_rate = strtod(optarg, NULL);
+      break;
+    case 'r':
+      poll_hz = strtoul(optarg, NULL, 0);
+      break;
+    case 'R':
+      replay = optarg;
+      live = 1;
+      break;
+    case 's':
+      seed_rng(strtoull(optarg, NULL, 0));
+      break;
+    case 't':
+      nclass[DEV_TOUCHPAD] = strtoul(optarg, NULL, 0);
+      break;
+    case 'T':
+      tp_hz = strtoul(optarg, NULL, 0);
+      break;
+    case 'u':
+      live = 1;
+      break;
+    case 'W':
+      wpm = strtod(optarg, NULL);
+      break;
+    default:
+      usage(argv[0]);
+    }
+
+  if (poll_hz <= 0 || tp_hz <= 0 || wpm <= 0 || burst_words < 1)
+    usage(argv[0]);
+
+  if (cycles > 0) {
+    for (i = 0; i < NUM_CLASSES; i++)
+      while (nclass[i]--)
+        if (add_gen_device(i) < 0)
+          errx(1, "too many devices");
+    play_hotplug(cycles);
+    return 0;
+  }
+
+  if (replay) {
+    if (!(f = fopen(replay, "r")))
+      err(1, "can't open %s", replay);
+    read_trace(f);
+    fclose(f);
+    qsort(events, num_events, sizeof(*events), cmp_event);
+  } else {
+    for (i = 0; i < NUM_CLASSES; i++)
+      while (nclass[i]--)
+        if (add_gen_device(i) < 0)
+          errx(1, "too many devices");
+    generate((uint64_t)(duration * USEC));
+  }
+
+  if (live) {
+    if (log && !(logf = fopen(log, "w")))
+      err(1, "can't open %s", log);
+    play_live(logf);
+    if (logf)
+      fclose(logf);
+    return 0;
+  }
+
+  if (!out || strcmp(out, "-") == 0)
+    f = stdout;
+  else if (!(f = fopen(out, "w")))
+    err(1, "can't open %s", out);
+  write_trace(f);
+  if (f != stdout)
+    fclose(f);
+  return 0;
+}
+
+static void usage(char *progname) {
+  fprintf(stderr,
+          "usage: %s [-u] [-b words] [-c prob] [-d seconds] [-k keyboards] "
+          "[-m typing:pointing:scroll:touchpad:idle] [-o trace] "
+          "[-p pointers] [-P palms] [-r hz] [-s seed] [-t touchpads] "
+          "[-T hz] [-W wpm] [-l log]\n"
+          "       %s -R trace [-l log]\n"
+          "       %s -H cycles [-k keyboards] [-p pointers] [-t touchpads]\n",
+          progname, progname, progname);
+  exit(1);
+}
+
+/* One splitmix64 step, so neighbouring seeds give unrelated streams */
+static void seed_rng(uint64_t seed) {
+  uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  rng_state = z ^ (z >> 31);
+  if (rng_state == 0) /* the one state xorshift never leaves */
+    rng_state = 0x9e3779b97f4a7c15ULL;
+}
+
+/* xorshift64*, so a seed always reproduces the same workload */
+static double urand(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return ((rng_state * 0x2545f4914f6cdd1dULL) >> 11) * 0x1.0p-53;
+}
+
+static double nrand(void) {
+  double u = urand(), v = urand();
+  return sqrt(-2 * log(u + 0x1.0p-60)) * cos(2 * M_PI * v);
+}
+
+/* Log-normal with the given mean; sigma controls the spread */
+static double lognrand(double mean, double sigma) {
+  return exp(log(mean) - sigma * sigma / 2 + sigma * nrand());
+}
+
+static double exprand(double mean) { return -mean * log(1 - urand()); }
+
+/* Minimum-jerk position profile, the usual model for aimed movements */
+static double minjerk(double tau) {
+  return tau * tau * tau * (10 - 15 * tau + 6 * tau * tau);
+}
+
+static int add_gen_device(int class) {
+  struct device *d;
+  int i, n = 0;
+
+  if (num_devices >= MAX_DEVICES)
+    return -1;
+  for (i = 0; i < num_devices; i++)
+    if (devices[i].class == class)
+      n++;
+  d = &devices[num_devices];
+  d->class = class;
+  d->fd = -1;
+  snprintf(d->name, sizeof(d->name), "bbgen %s %d", class_names[class], n);
+  return num_devices++;
+}
+
+static int pick_device(int class) {
+  int i, n = 0, which;
+
+  for (i = 0; i < num_devices; i++)
+    if (devices[i].class == class)
+      n++;
+  if (n == 0)
+    return -1;
+  which = urand() * n;
+  for (i = 0; i < num_devices; i++)
+    if (devices[i].class == class && which-- == 0)
+      return i;
+  return -1;
+}
+
+static void emit(int dev, uint64_t t, int type, int code, int value) {
+  if (num_events == max_events) {
+    max_events = max_events ? max_events * 2 : 65536;
+    if (!(events = realloc(events, max_events * sizeof(*events))))
+      err(1, "realloc");
+  }
+  events[num_events].t = t;
+  events[num_events].seq = num_events;
+  events[num_events].dev = dev;
+  events[num_events].type = type;
+  events[num_events].code = code;
+  events[num_events].value = value;
+  num_events++;
+}
+
+static void syn(int dev, uint64_t t) { emit(dev, t, EV_SYN, SYN_REPORT, 0); }
+
+static void key(int dev, uint64_t t, uint64_t hold, int code) {
+  emit(dev, t, EV_KEY, code, 1);
+  syn(dev, t);
+  emit(dev, t + hold, EV_KEY, code, 0);
+  syn(dev, t + hold);
+}
+
+/*
+ * Bursts of words typed with log-normal inter-key intervals around the
+ * configured words per minute, with occasional modifier chords and palm
+ * contacts on a touchpad.
+ */
+static uint64_t gen_typing(uint64_t t) {
+  int dev, pad, words, len, mod;
+  double iki = 60.0 / (wpm * 5);
+
+  if ((dev = pick_device(DEV_KEYBOARD)) < 0)
+    return t;
+  pad = pick_device(DEV_TOUCHPAD);
+
+  words = 1 + (int)exprand(burst_words - 1);
+  while (words--) {
+    if (urand() < chord_prob) {
+      mod = urand() < 0.5 ? KEY_LEFTCTRL : KEY_LEFTSHIFT;
+      emit(dev, t, EV_KEY, mod, 1);
+      syn(dev, t);
+      t += lognrand(0.12, 0.3) * USEC;
+      key(dev, t, lognrand(0.09, 0.3) * USEC,
+          letters[(int)(urand() * 26)]);
+      t += lognrand(0.15, 0.3) * USEC;
+      emit(dev, t, EV_KEY, mod, 0);
+      syn(dev, t);
+      t += lognrand(iki, 0.4) * USEC;
+      continue;
+    }
+    for (len = 2 + (int)exprand(3); len > 0; len--) {
+      /* Zipf-ish: frequent letters come first in the table */
+      key(dev, t, lognrand(0.09, 0.3) * USEC,
+          letters[(int)(26 * urand() * urand())]);
+      if (pad >= 0 && urand() < palm_rate / 60 * iki)
+        gen_palm(pad, t);
+      t += lognrand(iki, 0.4) * USEC;
+    }
+    key(dev, t, lognrand(0.08, 0.3) * USEC, KEY_SPACE);
+    t += lognrand(iki * 1.5, 0.5) * USEC;
+  }
+  return t;
+}
+
+/* Aimed movements sampled at the polling rate, sometimes ending in a click */
+static uint64_t gen_pointing(uint64_t t) {
+  int dev, segments, k, steps, dx, dy, lx, ly, x, y;
+  double dist, angle, dur, s;
+
+  if ((dev = pick_device(DEV_POINTER)) < 0)
+    return t;
+
+  for (segments = 1 + (int)exprand(2); segments > 0; segments--) {
+    dist = lognrand(300, 0.7);
+    angle = urand() * 2 * M_PI;
+    dur = 0.15 + 0.1 * log2(1 + dist / 10);
+    steps = dur * poll_hz;
+    lx = ly = 0;
+    for (k = 1; k <= steps; k++) {
+      s = minjerk((double)k / steps);
+      x = lround(dist * s * cos(angle) + nrand() * 0.3);
+      y = lround(dist * s * sin(angle) + nrand() * 0.3);
+      dx = x - lx;
+      dy = y - ly;
+      if (dx == 0 && dy == 0)
+        continue;
+      if (dx)
+        emit(dev, t + k * USEC / poll_hz, EV_REL, REL_X, dx);
+      if (dy)
+        emit(dev, t + k * USEC / poll_hz, EV_REL, REL_Y, dy);
+      syn(dev, t + k * USEC / poll_hz);
+      lx = x;
+      ly = y;
+    }
+    t += dur * USEC;
+    if (urand() < 0.3) {
+      t += lognrand(0.15, 0.4) * USEC;
+      emit(dev, t, EV_KEY, BTN_LEFT, 1);
+      syn(dev, t);
+      t += lognrand(0.09, 0.3) * USEC;
+      emit(dev, t, EV_KEY, BTN_LEFT, 0);
+      syn(dev, t);
+    }
+    t += exprand(0.3) * USEC;
+  }
+  return t;
+}
+
+/* A flick: wheel notches arriving quickly, then slowing down */
+static uint64_t gen_scroll(uint64_t t) {
+  int dev, notches, dir;
+  double gap = 0.012;
+
+  if ((dev = pick_device(DEV_POINTER)) < 0)
+    return t;
+
+  dir = urand() < 0.7 ? -1 : 1;
+  for (notches = 3 + (int)exprand(5); notches > 0; notches--) {
+    emit(dev, t, EV_REL, REL_WHEEL, dir);
+    emit(dev, t, EV_REL, REL_WHEEL_HI_RES, dir * 120);
+    syn(dev, t);
+    t += gap * USEC;
+    gap *= 1.2;
+  }
+  return t;
+}
+
+/* One-finger pointer motion or two-finger scrolling, in MT protocol B */
+static uint64_t gen_touchpad(uint64_t t) {
+  int dev, two, k, steps, x0, y0, x, y, x2;
+  double dist, angle, dur, s;
+  uint64_t ft;
+
+  if ((dev = pick_device(DEV_TOUCHPAD)) < 0)
+    return t;
+
+  two = urand() < 0.3;
+  x0 = TP_MAX_X / 4 + urand() * TP_MAX_X / 2;
+  y0 = TP_MAX_Y / 4 + urand() * TP_MAX_Y / 2;
+  dist = lognrand(20 * TP_RES, 0.5);
+  angle = two ? (urand() < 0.5 ? M_PI / 2 : -M_PI / 2) : urand() * 2 * M_PI;
+  dur = 0.2 + 0.1 * log2(1 + dist / TP_RES);
+  steps = dur * tp_hz;
+
+  for (k = 0; k <= steps; k++) {
+    ft = t + k * USEC / tp_hz;
+    s = minjerk((double)k / steps);
+    x = x0 + dist * s * cos(angle) + nrand() * 2;
+    y = y0 + dist * s * sin(angle) + nrand() * 2;
+    if (x < 0 || x > TP_MAX_X || y < 0 || y > TP_MAX_Y)
+      break;
+    emit(dev, ft, EV_ABS, ABS_MT_SLOT, 0);
+    if (k == 0)
+      emit(dev, ft, EV_ABS, ABS_MT_TRACKING_ID, ++tracking_id);
+    emit(dev, ft, EV_ABS, ABS_MT_POSITION_X, x);
+    emit(dev, ft, EV_ABS, ABS_MT_POSITION_Y, y);
+    if (two) {
+      emit(dev, ft, EV_ABS, ABS_MT_SLOT, 1);
+      if (k == 0)
+        emit(dev, ft, EV_ABS, ABS_MT_TRACKING_ID, ++tracking_id);
+      x2 = x + 25 * TP_RES;
+      emit(dev, ft, EV_ABS, ABS_MT_POSITION_X, x2 > TP_MAX_X ? TP_MAX_X : x2);
+      emit(dev, ft, EV_ABS, ABS_MT_POSITION_Y, y);
+    }
+    if (k == 0) {
+      emit(dev, ft, EV_KEY, BTN_TOUCH, 1);
+      emit(dev, ft, EV_KEY, two ? BTN_TOOL_DOUBLETAP : BTN_TOOL_FINGER, 1);
+    }
+    emit(dev, ft, EV_ABS, ABS_X, x);
+    emit(dev, ft, EV_ABS, ABS_Y, y);
+    syn(dev, ft);
+  }
+
+  t += (uint64_t)(dur * USEC) + USEC / tp_hz;
+  emit(dev, t, EV_ABS, ABS_MT_SLOT, 0);
+  emit(dev, t, EV_ABS, ABS_MT_TRACKING_ID, -1);
+  if (two) {
+    emit(dev, t, EV_ABS, ABS_MT_SLOT, 1);
+    emit(dev, t, EV_ABS, ABS_MT_TRACKING_ID, -1);
+  }
+  emit(dev, t, EV_KEY, BTN_TOUCH, 0);
+  emit(dev, t, EV_KEY, two ? BTN_TOOL_DOUBLETAP : BTN_TOOL_FINGER, 0);
+  syn(dev, t);
+  return t + exprand(0.3) * USEC;
+}
+
+/* A short, wide contact near the bottom edge while typing, in its own slot */
+static void gen_palm(int dev, uint64_t t) {
+  int k, frames, x, y;
+
+  x = urand() < 0.5 ? TP_MAX_X / 10 : TP_MAX_X * 9 / 10;
+  y = TP_MAX_Y * 9 / 10;
+  t += exprand(0.05) * USEC;
+  for (k = 0, frames = 3 + urand() * 6; k < frames; k++) {
+    emit(dev, t, EV_ABS, ABS_MT_SLOT, TP_PALM_SLOT);
+    if (k == 0)
+      emit(dev, t, EV_ABS, ABS_MT_TRACKING_ID, ++tracking_id);
+    emit(dev, t, EV_ABS, ABS_MT_TOUCH_MAJOR, 1500 + nrand() * 100);
+    emit(dev, t, EV_ABS, ABS_MT_POSITION_X, x + nrand() * 5);
+    emit(dev, t, EV_ABS, ABS_MT_POSITION_Y, y + nrand() * 5);
+    if (k == 0)
+      emit(dev, t, EV_KEY, BTN_TOUCH, 1);
+    syn(dev, t);
+    t += USEC / tp_hz;
+  }
+  emit(dev, t, EV_ABS, ABS_MT_SLOT, TP_PALM_SLOT);
+  emit(dev, t, EV_ABS, ABS_MT_TRACKING_ID, -1);
+  emit(dev, t, EV_KEY, BTN_TOUCH, 0);
+  syn(dev, t);
+}
+
+static void generate(uint64_t duration) {
+  uint64_t t = 0;
+  double total, r;
+  int i;
+
+  /* Activities without a device to perform them are left out of the mix */
+  if (pick_device(DEV_KEYBOARD) < 0)
+    mix[ACT_TYPING] = 0;
+  if (pick_device(DEV_POINTER) < 0)
+    mix[ACT_POINTING] = mix[ACT_SCROLL] = 0;
+  if (pick_device(DEV_TOUCHPAD) < 0)
+    mix[ACT_TOUCHPAD] = 0;
+  for (total = 0, i = 0; i < NUM_ACTIVITIES; i++)
+    total += mix[i];
+  if (total <= 0)
+    errx(1, "nothing to generate");
+
+  while (t < duration) {
+    r = urand() * total;
+    for (i = 0; i < NUM_ACTIVITIES - 1 && r >= mix[i]; i++)
+      r -= mix[i];
+    switch (i) {
+    case ACT_TYPING:
+      t = gen_typing(t);
+      break;
+    case ACT_POINTING:
+      t = gen_pointing(t);
+      break;
+    case ACT_SCROLL:
+      t = gen_scroll(t);
+      break;
+    case ACT_TOUCHPAD:
+      t = gen_touchpad(t);
+      break;
+    case ACT_IDLE:
+      t += exprand(3) * USEC;
+      break;
+    }
+    t += exprand(0.5) * USEC;
+  }
+
+  qsort(events, num_events, sizeof(*events), cmp_event);
+  while (num_events && events[num_events - 1].t > duration)
+    num_events--;
+}
+
+static int cmp_event(const void *a, const void *b) {
+  const struct event *ea = a, *eb = b;
+
+  if (ea->t != eb->t)
+    return ea->t < eb->t ? -1 : 1;
+  return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+static void write_trace(FILE *f) {
+  size_t i;
+
+  fprintf(f, "# betterbanish trace\n");
+  for (i = 0; i < (size_t)num_devices; i++)
+    fprintf(f, "device %zu %s %s\n", i, class_names[devices[i].class],
+            devices[i].name);
+  for (i = 0; i < num_events; i++)
+    fprintf(f, "%llu.%06llu %u %u %u %d\n",
+            (unsigned long long)(events[i].t / USEC),
+            (unsigned long long)(events[i].t % USEC), events[i].dev,
+            events[i].type, events[i].code, events[i].value);
+}
+
+static void read_trace(FILE *f) {
+  char line[256], class[16], name[64];
+  unsigned long long sec, usec;
+  unsigned int id, type, code;
+  int value, i, lineno = 0;
+
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    if (sscanf(line, "device %u %15s %63[^\n]", &id, class, name) == 3) {
+      if (id != (unsigned int)num_devices || id >= MAX_DEVICES)
+        errx(1, "line %d: devices must be numbered in order", lineno);
+      for (i = 0; i < NUM_CLASSES; i++)
+        if (strcmp(class, class_names[i]) == 0)
+          break;
+      if (i == NUM_CLASSES)
+        errx(1, "line %d: unknown device class %s", lineno, class);
+      add_gen_device(i);
+      strcpy(devices[id].name, name);
+    } else if (sscanf(line, "%llu.%llu %u %u %u %d", &sec, &usec, &id, &type,
+                      &code, &value) == 6) {
+      if (id >= (unsigned int)num_devices)
+        errx(1, "line %d: undeclared device %u", lineno, id);
+      emit(id, sec * USEC + usec, type, code, value);
+    } else
+      errx(1, "line %d: malformed record", lineno);
+  }
+}
+
+static int uinput_create(struct device *d) {
+  static const struct {
+    int code, max;
+  } tp_axes[] = {
+      {ABS_X, TP_MAX_X},
+      {ABS_Y, TP_MAX_Y},
+      {ABS_MT_SLOT, 4},
+      {ABS_MT_TRACKING_ID, 65535},
+      {ABS_MT_POSITION_X, TP_MAX_X},
+      {ABS_MT_POSITION_Y, TP_MAX_Y},
+      {ABS_MT_TOUCH_MAJOR, 2000},
+  };
+  struct uinput_setup us;
+  struct uinput_abs_setup abs;
+  size_t i;
+  int fd;
+
+  if ((fd = open("/dev/uinput", O_WRONLY | O_CLOEXEC)) < 0)
+    return -1;
+
+  ioctl(fd, UI_SET_EVBIT, EV_SYN);
+  ioctl(fd, UI_SET_EVBIT, EV_KEY);
+  switch (d->class) {
+  case DEV_KEYBOARD:
+    for (i = KEY_ESC; i <= KEY_MICMUTE; i++)
+      ioctl(fd, UI_SET_KEYBIT, i);
+    break;
+  case DEV_POINTER:
+    ioctl(fd, UI_SET_EVBIT, EV_REL);
+    ioctl(fd, UI_SET_RELBIT, REL_X);
+    ioctl(fd, UI_SET_RELBIT, REL_Y);
+    ioctl(fd, UI_SET_RELBIT, REL_WHEEL);
+    ioctl(fd, UI_SET_RELBIT, REL_WHEEL_HI_RES);
+    ioctl(fd, UI_SET_KEYBIT, BTN_LEFT);
+    ioctl(fd, UI_SET_KEYBIT, BTN_RIGHT);
+    ioctl(fd, UI_SET_KEYBIT, BTN_MIDDLE);
+    break;
+  case DEV_TOUCHPAD:
+    ioctl(fd, UI_SET_EVBIT, EV_ABS);
+    ioctl(fd, UI_SET_KEYBIT, BTN_LEFT);
+    ioctl(fd, UI_SET_KEYBIT, BTN_TOUCH);
+    ioctl(fd, UI_SET_KEYBIT, BTN_TOOL_FINGER);
+    ioctl(fd, UI_SET_KEYBIT, BTN_TOOL_DOUBLETAP);
+    ioctl(fd, UI_SET_PROPBIT, INPUT_PROP_POINTER);
+    for (i = 0; i < sizeof(tp_axes) / sizeof(tp_axes[0]); i++) {
+      ioctl(fd, UI_SET_ABSBIT, tp_axes[i].code);
+      memset(&abs, 0, sizeof(abs));
+      abs.code = tp_axes[i].code;
+      abs.absinfo.maximum = tp_axes[i].max;
+      if (abs.code != ABS_MT_SLOT && abs.code != ABS_MT_TRACKING_ID &&
+          abs.code != ABS_MT_TOUCH_MAJOR)
+        abs.absinfo.resolution = TP_RES;
+      if (ioctl(fd, UI_ABS_SETUP, &abs) < 0)
+        goto fail;
+    }
+    break;
+  }
+
+  memset(&us, 0, sizeof(us));
+  us.id.bustype = BUS_VIRTUAL;
+  us.id.vendor = 0x1209;
+  us.id.product = 0xbb00 + d->class;
+  strncpy(us.name, d->name, UINPUT_MAX_NAME_SIZE - 1);
+  if (ioctl(fd, UI_DEV_SETUP, &us) < 0 || ioctl(fd, UI_DEV_CREATE) < 0)
+    goto fail;
+  return fd;
+
+fail:
+  close(fd);
+  return -1;
+}
+
+static void play_live(FILE *log) {
+  struct input_event ie;
+  struct timespec start, ts, now;
+  uint64_t t;
+  size_t i;
+  int j;
+
+  for (j = 0; j < num_devices; j++)
+    if ((devices[j].fd = uinput_create(&devices[j])) < 0)
+      err(1, "can't create uinput device %s", devices[j].name);
+
+  /* Give udev and the daemon under test time to pick the devices up */
+  sleep(1);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  memset(&ie, 0, sizeof(ie));
+  for (i = 0; i < num_events; i++) {
+    t = (uint64_t)start.tv_nsec / 1000 + events[i].t;
+    ts.tv_sec = start.tv_sec + t / USEC;
+    ts.tv_nsec = (t % USEC) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+    ie.type = events[i].type;
+    ie.code = events[i].code;
+    ie.value = events[i].value;
+    if (write(devices[events[i].dev].fd, &ie, sizeof(ie)) != sizeof(ie))
+      err(1, "write to uinput");
+    if (!log || ie.type == EV_SYN || (ie.type == EV_KEY && ie.value != 1))
+      continue;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(log, "%lld%09ld %s\n", (long long)now.tv_sec, now.tv_nsec,
+            devices[events[i].dev].class == DEV_KEYBOARD ? "key" : "pointer");
+  }
+
+  for (j = 0; j < num_devices; j++) {
+    ioctl(devices[j].fd, UI_DEV_DESTROY);
+    close(devices[j].fd);
+  }
+}
+
+/* A hotplug storm: every device appears and disappears, with no pause */
+static void play_hotplug(int cycles) {
+  int c, j;
+
+  for (c = 0; c < cycles; c++) {
+    for (j = 0; j < num_devices; j++)
+      if ((devices[j].fd = uinput_create(&devices[j])) < 0)
+        err(1, "can't create uinput device %s", devices[j].name);
+    for (j = 0; j < num_devices; j++) {
+      ioctl(devices[j].fd, UI_DEV_DESTROY);
+      close(devices[j].fd);
+    }
+  }
+}
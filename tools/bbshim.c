@@ -0,0 +1,119 @@
+/*
+ * bbshim.c - LD_PRELOAD shim for comparing cursor hiding daemons
+ *
+ * Logs when the program it is loaded into hides or shows the cursor through
+ * XFixes, along with the number of X requests it has issued so far, to the
+ * file named by $BBSHIM_LOG.  SIGUSR2 logs the request count on demand.
+ * Lines are "<CLOCK_MONOTONIC ns> hide|show|requests <requests>".
+ *
+ * This works with any daemon that uses Xlib and libXfixes dynamically, so
+ * competitors can be measured without modifying them.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+
+void XFixesHideCursor(Display *, Window);
+void XFixesShowCursor(Display *, Window);
+
+static void log_line(const char *);
+static char *put_number(char *, uint64_t);
+static void dump_requests(int);
+static void *real(const char *);
+
+static Display *display = NULL;
+static int log_fd = -1;
+
+__attribute__((constructor)) static void init(void) {
+  struct sigaction sa;
+  const char *path;
+
+  if (!(path = getenv("BBSHIM_LOG")))
+    return;
+  if ((log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                     0644)) < 0)
+    return;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = dump_requests;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR2, &sa, NULL);
+}
+
+static void *real(const char *name) {
+  void *sym = dlsym(RTLD_NEXT, name);
+
+  if (!sym)
+    abort();
+  return sym;
+}
+
+Display *XOpenDisplay(const char *name) {
+  static Display *(*fn)(const char *);
+  Display *d;
+
+  if (!fn)
+    fn = real("XOpenDisplay");
+  if ((d = fn(name)) && !display)
+    display = d;
+  return d;
+}
+
+void XFixesHideCursor(Display *d, Window w) {
+  static void (*fn)(Display *, Window);
+
+  if (!fn)
+    fn = real("XFixesHideCursor");
+  fn(d, w);
+  log_line("hide");
+}
+
+void XFixesShowCursor(Display *d, Window w) {
+  static void (*fn)(Display *, Window);
+
+  if (!fn)
+    fn = real("XFixesShowCursor");
+  fn(d, w);
+  log_line("show");
+}
+
+static void dump_requests(int sig) { log_line("requests"); }
+
+static char *put_number(char *p, uint64_t n) {
+  char tmp[24];
+  int i = 0;
+
+  do
+    tmp[i++] = '0' + n % 10;
+  while ((n /= 10));
+  while (i)
+    *p++ = tmp[--i];
+  return p;
+}
+
+/* Also called from a signal handler, so no stdio */
+static void log_line(const char *what) {
+  struct timespec ts;
+  char buf[96], *p = buf;
+
+  if (log_fd < 0)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  p = put_number(p, (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+  *p++ = ' ';
+  memcpy(p, what, strlen(what));
+  p += strlen(what);
+  *p++ = ' ';
+  p = put_number(p, display ? NextRequest(display) - 1 : 0);
+  *p++ = '\n';
+  write(log_fd, buf, p - buf);
+}
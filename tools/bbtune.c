@@ -0,0 +1,645 @@
+/*
+ * bbtune.c - offline policy tuner for betterbanish
+ *
+ * Replays every trace in a directory (in the format written by bbgen)
+ * through a model of betterbanish's hide/show decisions, once for every
+ * combination of the option values given, and ranks the combinations.
+ *
+ * The model follows main(), hide_cursor() and show_cursor() in
+ * betterbanish.c, including which X requests each step issues, and has to
+ * be kept in step with them.  Pointer position is tracked from relative
+ * motion (and scaled absolute motion) for the -j check.
+ *
+ * Replays run on a work-stealing thread pool, one worker per core.
+ */
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/input.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_VALUES 32
+#define MAX_DEVICES 32
+#define FLAP_US 500000           /* reversal this soon after a change */
+#define SPURIOUS_US 300000       /* look-ahead after an unhide */
+#define SPURIOUS_PX 10           /* less motion than this is spurious */
+#define ABS_SCALE 4              /* absolute units per pixel, roughly */
+#define SCREEN_W 1920
+#define SCREEN_H 1080
+
+/* X modifier masks, as in X11/X.h */
+#define SHIFT_MASK (1 << 0)
+#define LOCK_MASK (1 << 1)
+#define CONTROL_MASK (1 << 2)
+#define MOD1_MASK (1 << 3)
+#define MOD2_MASK (1 << 4)
+#define MOD3_MASK (1 << 5)
+#define MOD4_MASK (1 << 6)
+#define MOD5_MASK (1 << 7)
+
+/* Events are reduced to what the decision logic looks at when loading */
+enum kinds {
+  K_KEY,        /* keyboard key press; mod is the key's own modifier */
+  K_MOD_UP,     /* modifier release */
+  K_MOTION,     /* pointer motion; dx, dy in pixels */
+  K_POINTER,    /* other pointer event; mod is set for clicks and scrolls */
+};
+
+struct tev {
+  uint64_t t; /* usec */
+  int16_t dx, dy;
+  uint8_t kind, mod;
+};
+
+struct trace {
+  char *name;
+  struct tev *ev;
+  size_t n;
+};
+
+struct config {
+  int count, jitter, timeout;
+  unsigned int ignored;
+  const char *ignored_name;
+};
+
+struct result {
+  unsigned long flaps, spurious, xreqs, hides, unhides;
+  unsigned long key_hides;
+  uint64_t hide_latency; /* usec from the first key press after a show */
+  uint64_t count_wait;   /* usec of that spent on the -c threshold */
+};
+
+/* One deque of job indices per worker, stolen from at the back */
+struct worker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  size_t head, tail;
+  unsigned long events;
+};
+
+static void usage(char *);
+static int parse_ints(char *, int *);
+static int parse_mods(char *, unsigned int *, const char **);
+static unsigned int key_mod(int);
+static void load_trace(const char *, const char *);
+static void replay(const struct trace *, const struct config *,
+                   struct result *);
+static int take(struct worker *, size_t *);
+static int steal(int, size_t *);
+static void *work(void *);
+static double score(const struct result *);
+static int cmp_rank(const void *, const void *);
+
+static struct trace *traces = NULL;
+static size_t num_traces = 0;
+static struct config *configs = NULL;
+static size_t num_configs = 0;
+static struct result *results = NULL, *totals = NULL;
+static struct worker *workers = NULL;
+static int num_workers = 0;
+static const char *sort_key = "score";
+
+int main(int argc, char *argv[]) {
+  int counts[MAX_VALUES] = {1}, jitters[MAX_VALUES] = {0},
+      timeouts[MAX_VALUES] = {0};
+  unsigned int mods[MAX_VALUES] = {0};
+  const char *mod_names[MAX_VALUES] = {"none"};
+  int ncounts = 1, njitters = 1, ntimeouts = 1, nmods = 1;
+  int ch, a, b, c, d, w, top = 10;
+  size_t i, j, jobs, *order;
+  unsigned long events = 0;
+  struct timespec start, end;
+  struct dirent *entry;
+  char path[PATH_MAX];
+  char *progname = argv[0];
+  double secs;
+  DIR *dir;
+
+  while ((ch = getopt(argc, argv, "c:i:j:n:s:t:T:")) != -1)
+    switch (ch) {
+    case 'c':
+      ncounts = parse_ints(optarg, counts);
+      break;
+    case 'i':
+      nmods = parse_mods(optarg, mods, mod_names);
+      break;
+    case 'j':
+      njitters = parse_ints(optarg, jitters);
+      break;
+    case 'n':
+      top = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      sort_key = optarg;
+      if (strcmp(sort_key, "score") && strcmp(sort_key, "flaps") &&
+          strcmp(sort_key, "spurious") && strcmp(sort_key, "xreqs") &&
+          strcmp(sort_key, "latency"))
+        usage(progname);
+      break;
+    case 't':
+      ntimeouts = parse_ints(optarg, timeouts);
+      break;
+    case 'T':
+      num_workers = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      usage(progname);
+    }
+  argc -= optind;
+  argv += optind;
+  if (argc != 1 || ncounts < 1 || njitters < 1 || ntimeouts < 1 || nmods < 1)
+    usage(progname);
+
+  if (!(dir = opendir(argv[0])))
+    err(1, "can't open %s", argv[0]);
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", argv[0], entry->d_name);
+    load_trace(path, entry->d_name);
+  }
+  closedir(dir);
+  if (num_traces == 0)
+    errx(1, "no traces in %s", argv[0]);
+
+  num_configs = ncounts * njitters * ntimeouts * nmods;
+  if (!(configs = calloc(num_configs, sizeof(*configs))))
+    err(1, "calloc");
+  i = 0;
+  for (a = 0; a < ncounts; a++)
+    for (b = 0; b < njitters; b++)
+      for (c = 0; c < ntimeouts; c++)
+        for (d = 0; d < nmods; d++, i++) {
+          configs[i].count = counts[a];
+          configs[i].jitter = jitters[b];
+          configs[i].timeout = timeouts[c];
+          configs[i].ignored = mods[d];
+          configs[i].ignored_name = mod_names[d];
+        }
+
+  jobs = num_configs * num_traces;
+  if (!(results = calloc(jobs, sizeof(*results))) ||
+      !(totals = calloc(num_configs, sizeof(*totals))))
+    err(1, "calloc");
+
+  if (num_workers <= 0)
+    num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_workers < 1)
+    num_workers = 1;
+  if (!(workers = calloc(num_workers, sizeof(*workers))))
+    err(1, "calloc");
+
+  /* Start everyone with an even share; stealing evens out the rest */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (w = 0; w < num_workers; w++) {
+    pthread_mutex_init(&workers[w].lock, NULL);
+    workers[w].head = jobs * w / num_workers;
+    workers[w].tail = jobs * (w + 1) / num_workers;
+  }
+  for (w = 0; w < num_workers; w++)
+    if ((errno = pthread_create(&workers[w].thread, NULL, work,
+                                &workers[w])) != 0)
+      err(1, "pthread_create");
+  for (w = 0; w < num_workers; w++) {
+    pthread_join(workers[w].thread, NULL);
+    events += workers[w].events;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (i = 0; i < num_configs; i++) {
+    for (j = 0; j < num_traces; j++) {
+      struct result *r = &results[i * num_traces + j];
+      totals[i].flaps += r->flaps;
+      totals[i].spurious += r->spurious;
+      totals[i].xreqs += r->xreqs;
+      totals[i].hides += r->hides;
+      totals[i].unhides += r->unhides;
+      totals[i].key_hides += r->key_hides;
+      totals[i].hide_latency += r->hide_latency;
+      totals[i].count_wait += r->count_wait;
+    }
+  }
+
+  if (!(order = calloc(num_configs, sizeof(*order))))
+    err(1, "calloc");
+  for (i = 0; i < num_configs; i++)
+    order[i] = i;
+  qsort(order, num_configs, sizeof(*order), cmp_rank);
+
+  printf("%5s %5s %5s %-14s %7s %8s %9s %7s %7s %11s %9s %9s\n", "-c", "-j",
+         "-t", "-i", "hides", "unhides", "flaps", "spur", "X reqs", "hide ms",
+         "-c ms", "score");
+  for (i = 0; i < num_configs && (top <= 0 || i < (size_t)top); i++) {
+    struct config *cf = &configs[order[i]];
+    struct result *r = &totals[order[i]];
+    printf("%5d %5d %5d %-14s %7lu %8lu %9lu %7lu %7lu %11.1f %9.1f %9.1f\n",
+           cf->count, cf->jitter, cf->timeout, cf->ignored_name, r->hides,
+           r->unhides, r->flaps, r->spurious, r->xreqs,
+           r->key_hides ? r->hide_latency / 1000.0 / r->key_hides : 0,
+           r->key_hides ? r->count_wait / 1000.0 / r->key_hides : 0,
+           score(r));
+  }
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr,
+          "%zu traces x %zu configurations, %lu events in %.2fs on %d "
+          "threads (%.1fM events/s per thread)\n",
+          num_traces, num_configs, events, secs, num_workers,
+          events / secs / num_workers / 1e6);
+  return 0;
+}
+
+static void usage(char *progname) {
+  fprintf(stderr,
+          "usage: %s [-c counts] [-i mods] [-j pixels] [-n top] "
+          "[-s score|flaps|spurious|xreqs|latency] [-t seconds] "
+          "[-T threads] tracedir\n"
+          "values are comma separated lists; modifier sets are "
+          "'+'-joined names, 'all' or 'none'\n",
+          progname);
+  exit(1);
+}
+
+static int parse_ints(char *s, int *out) {
+  char *tok;
+  int n = 0;
+
+  for (tok = strtok(s, ","); tok && n < MAX_VALUES; tok = strtok(NULL, ","))
+    out[n++] = strtol(tok, NULL, 0);
+  return n;
+}
+
+static int parse_mods(char *s, unsigned int *out, const char **names) {
+  static const struct {
+    const char *name;
+    unsigned int mask;
+  } mods[] = {
+      {"shift", SHIFT_MASK}, {"lock", LOCK_MASK}, {"control", CONTROL_MASK},
+      {"mod1", MOD1_MASK},   {"mod2", MOD2_MASK}, {"mod3", MOD3_MASK},
+      {"mod4", MOD4_MASK},   {"mod5", MOD5_MASK},
+      /* Like the daemon, "all" leaves NumLock alone */
+      {"all", 0xff & ~MOD2_MASK}, {"none", 0},
+  };
+  char *tok, *save, *name, *save2;
+  size_t i;
+  int n = 0;
+
+  for (tok = strtok_r(s, ",", &save); tok && n < MAX_VALUES;
+       tok = strtok_r(NULL, ",", &save), n++) {
+    names[n] = strdup(tok);
+    out[n] = 0;
+    for (name = strtok_r(tok, "+", &save2); name;
+         name = strtok_r(NULL, "+", &save2)) {
+      for (i = 0; i < sizeof(mods) / sizeof(mods[0]); i++)
+        if (strcasecmp(name, mods[i].name) == 0)
+          break;
+      if (i == sizeof(mods) / sizeof(mods[0]))
+        errx(1, "unknown modifier %s", name);
+      out[n] |= mods[i].mask;
+    }
+  }
+  return n;
+}
+
+/* The usual pc105 modifier map */
+static unsigned int key_mod(int code) {
+  switch (code) {
+  case KEY_LEFTSHIFT:
+  case KEY_RIGHTSHIFT:
+    return SHIFT_MASK;
+  case KEY_CAPSLOCK:
+    return LOCK_MASK;
+  case KEY_LEFTCTRL:
+  case KEY_RIGHTCTRL:
+    return CONTROL_MASK;
+  case KEY_LEFTALT:
+    return MOD1_MASK;
+  case KEY_NUMLOCK:
+    return MOD2_MASK;
+  case KEY_LEFTMETA:
+  case KEY_RIGHTMETA:
+    return MOD4_MASK;
+  case KEY_RIGHTALT:
+    return MOD5_MASK;
+  }
+  return 0;
+}
+
+static void load_trace(const char *path, const char *name) {
+  char line[256], class[16];
+  int is_keyboard[MAX_DEVICES] = {0}, last[MAX_DEVICES][2];
+  unsigned long long sec, usec;
+  unsigned int id, type, code;
+  struct trace *tr;
+  struct tev *e;
+  size_t max = 0;
+  unsigned long malformed = 0;
+  int value, num_devices = 0;
+  struct stat st;
+  FILE *f;
+
+  for (id = 0; id < MAX_DEVICES; id++)
+    last[id][0] = last[id][1] = INT_MIN;
+
+  if (!(f = fopen(path, "r"))) {
+    warn("can't open %s", path);
+    return;
+  }
+  if (fstat(fileno(f), &st) < 0 || !S_ISREG(st.st_mode)) {
+    fclose(f);
+    return;
+  }
+  if (!(traces = realloc(traces, (num_traces + 1) * sizeof(*traces))))
+    err(1, "realloc");
+  tr = &traces[num_traces];
+  memset(tr, 0, sizeof(*tr));
+  tr->name = strdup(name);
+
+  while (fgets(line, sizeof(line), f)) {
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    if (sscanf(line, "device %u %15s", &id, class) == 2) {
+      if (id < MAX_DEVICES) {
+        is_keyboard[id] = strcmp(class, "keyboard") == 0;
+        if ((int)id >= num_devices)
+          num_devices = id + 1;
+      }
+      continue;
+    }
+    if (sscanf(line, "%llu.%llu %u %u %u %d", &sec, &usec, &id, &type, &code,
+               &value) != 6 ||
+        id >= (unsigned int)num_devices) {
+      malformed++;
+      continue;
+    }
+
+    if (tr->n == max) {
+      max = max ? max * 2 : 4096;
+      if (!(tr->ev = realloc(tr->ev, max * sizeof(*tr->ev))))
+        err(1, "realloc");
+    }
+    e = &tr->ev[tr->n];
+    memset(e, 0, sizeof(*e));
+    e->t = sec * 1000000 + usec;
+
+    /* Mirror the checks in the daemon's keyboard and pointer loops */
+    if (is_keyboard[id]) {
+      if (type != EV_KEY)
+        continue;
+      e->mod = key_mod(code);
+      if (value == 1)
+        e->kind = K_KEY;
+      else if (value == 0 && e->mod)
+        e->kind = K_MOD_UP;
+      else
+        continue;
+    } else if (type == EV_REL) {
+      e->kind = K_MOTION;
+      if (code == REL_X)
+        e->dx = value;
+      else if (code == REL_Y)
+        e->dy = value;
+      else {
+        e->kind = K_POINTER;
+        e->mod = 1; /* scrolling */
+      }
+    } else if (type == EV_ABS) {
+      /* Absolute positions become deltas against the previous sample */
+      e->kind = K_MOTION;
+      if (code == ABS_X) {
+        if (last[id][0] != INT_MIN)
+          e->dx = (value - last[id][0]) / ABS_SCALE;
+        last[id][0] = value;
+      } else if (code == ABS_Y) {
+        if (last[id][1] != INT_MIN)
+          e->dy = (value - last[id][1]) / ABS_SCALE;
+        last[id][1] = value;
+      } else
+        e->kind = K_POINTER;
+    } else if (type == EV_KEY && value == 1) {
+      /* A button, not just a finger landing on a touchpad */
+      e->kind = K_POINTER;
+      e->mod = code >= BTN_MOUSE && code < BTN_JOYSTICK;
+    } else
+      continue;
+    tr->n++;
+  }
+  fclose(f);
+  if (malformed)
+    warnx("%s: skipped %lu malformed record%s", name, malformed,
+          malformed == 1 ? "" : "s");
+  num_traces++;
+}
+
+/*
+ * The decision logic of betterbanish for one trace and one configuration.
+ * Request counts, for a local display: with -i, XQueryKeymap per key press;
+ * XQueryPointer and XFixesHideCursor per hide; with -t, XSyncDestroyAlarm
+ * (after the first) and XSyncCreateAlarm per pointer event; with -j,
+ * XQueryPointer per pointer event while hidden; XFixesShowCursor per
+ * unhide.  The daemon's remote mode (-R) is not modelled.
+ */
+static void replay(const struct trace *tr, const struct config *cf,
+                   struct result *r) {
+  const struct tev *e, *end = tr->ev + tr->n;
+  uint64_t last_input = 0, last_change = 0, first_key = 0, show_at = 0;
+  uint64_t first_press = 0;
+  int pressed = 0;
+  uint64_t timeout_us = (uint64_t)cf->timeout * 1000000;
+  int hiding = 0, keystrokes = 0, alarm = 0, alarm_exists = 0, was_hide = 0;
+  int x = SCREEN_W / 2, y = SCREEN_H / 2, hide_x = 0, hide_y = 0;
+  int pending = 0, moved = 0, held = 0;
+
+  memset(r, 0, sizeof(*r));
+  for (e = tr->ev; e < end; e++) {
+    /* Idle alarm, armed by the last pointer event, fires in between */
+    if (alarm && !hiding && e->t - last_input >= timeout_us) {
+      alarm = 0;
+      hiding = 1;
+      hide_x = x;
+      hide_y = y;
+      r->hides++;
+      r->xreqs += 2;
+      pressed = 0;
+      if (!was_hide && last_input + timeout_us - last_change < FLAP_US)
+        r->flaps++;
+      was_hide = 1;
+      last_change = last_input + timeout_us;
+    }
+
+    /* Settle whether the last unhide was worth it */
+    if (pending && (e->t - show_at > SPURIOUS_US || hiding)) {
+      if (moved < SPURIOUS_PX)
+        r->spurious++;
+      pending = 0;
+    }
+    last_input = e->t;
+
+    switch (e->kind) {
+    case K_MOD_UP:
+      held &= ~e->mod;
+      continue;
+    case K_KEY:
+      held |= e->mod;
+      if (cf->ignored)
+        r->xreqs++;
+      /* Latency runs from any press, even one that is ignored or uncounted */
+      if (!hiding && !pressed) {
+        first_press = e->t;
+        pressed = 1;
+      }
+      if (held & cf->ignored)
+        continue;
+      if (!hiding && keystrokes == 0)
+        first_key = e->t;
+      if (++keystrokes >= cf->count && !hiding) {
+        hiding = 1;
+        hide_x = x;
+        hide_y = y;
+        r->hides++;
+        r->key_hides++;
+        r->xreqs += 2;
+        r->hide_latency += e->t - first_press;
+        r->count_wait += e->t - first_key;
+        pressed = 0;
+        if (!was_hide && e->t - last_change < FLAP_US)
+          r->flaps++;
+        was_hide = 1;
+        last_change = e->t;
+      }
+      continue;
+    case K_MOTION:
+      x += e->dx;
+      y += e->dy;
+      x = x < 0 ? 0 : x >= SCREEN_W ? SCREEN_W - 1 : x;
+      y = y < 0 ? 0 : y >= SCREEN_H ? SCREEN_H - 1 : y;
+      if (pending)
+        moved += abs(e->dx) + abs(e->dy);
+      break;
+    case K_POINTER:
+      if (pending && e->mod)
+        moved += SPURIOUS_PX; /* clicks and scrolls are deliberate */
+      break;
+    }
+
+    /* show_cursor() */
+    keystrokes = 0;
+    if (timeout_us) {
+      r->xreqs += 1 + alarm_exists;
+      alarm = alarm_exists = 1;
+    }
+    if (!hiding)
+      continue;
+    if (cf->jitter) {
+      r->xreqs++;
+      if (abs(x - hide_x) < cf->jitter && abs(y - hide_y) < cf->jitter)
+        continue;
+    }
+    hiding = 0;
+    r->unhides++;
+    r->xreqs++;
+    if (was_hide && e->t - last_change < FLAP_US)
+      r->flaps++;
+    was_hide = 0;
+    last_change = e->t;
+    pending = 1;
+    moved = 0;
+    show_at = e->t;
+  }
+  if (pending && moved < SPURIOUS_PX)
+    r->spurious++;
+}
+
+static int take(struct worker *w, size_t *job) {
+  int ok = 0;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->head < w->tail) {
+    *job = w->head++;
+    ok = 1;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return ok;
+}
+
+/* Move the back half of the fullest-looking victim's range to ourselves */
+static int steal(int self, size_t *job) {
+  struct worker *me = &workers[self], *v;
+  size_t half, from;
+  int i;
+
+  for (i = 1; i < num_workers; i++) {
+    v = &workers[(self + i) % num_workers];
+    pthread_mutex_lock(&v->lock);
+    if (v->head < v->tail) {
+      half = (v->tail - v->head + 1) / 2;
+      from = v->tail -= half;
+      pthread_mutex_unlock(&v->lock);
+
+      /* Other thieves may shrink the victim further once it is unlocked */
+      pthread_mutex_lock(&me->lock);
+      me->head = from;
+      me->tail = from + half;
+      *job = me->head++;
+      pthread_mutex_unlock(&me->lock);
+      return 1;
+    }
+    pthread_mutex_unlock(&v->lock);
+  }
+  return 0;
+}
+
+static void *work(void *arg) {
+  struct worker *w = arg;
+  size_t job;
+
+  while (take(w, &job) || steal(w - workers, &job)) {
+    replay(&traces[job % num_traces], &configs[job / num_traces],
+           &results[job]);
+    w->events += traces[job % num_traces].n;
+  }
+  return NULL;
+}
+
+/*
+ * Lower is better.  A flap or a spurious unhide is what users notice, so
+ * they dominate; latency and X traffic break ties.
+ */
+static double score(const struct result *r) {
+  return r->flaps * 10.0 + r->spurious * 5.0 + r->xreqs * 0.001 +
+         (r->key_hides ? r->hide_latency / 1000.0 / r->key_hides : 0) * 0.1;
+}
+
+static int cmp_rank(const void *a, const void *b) {
+  const struct result *ra = &totals[*(const size_t *)a];
+  const struct result *rb = &totals[*(const size_t *)b];
+  double va, vb;
+
+  if (strcmp(sort_key, "flaps") == 0) {
+    va = ra->flaps;
+    vb = rb->flaps;
+  } else if (strcmp(sort_key, "spurious") == 0) {
+    va = ra->spurious;
+    vb = rb->spurious;
+  } else if (strcmp(sort_key, "xreqs") == 0) {
+    va = ra->xreqs;
+    vb = rb->xreqs;
+  } else if (strcmp(sort_key, "latency") == 0) {
+    va = ra->key_hides ? (double)ra->hide_latency / ra->key_hides : 0;
+    vb = rb->key_hides ? (double)rb->hide_latency / rb->key_hides : 0;
+  } else {
+    va = score(ra);
+    vb = score(rb);
+  }
+  return (va > vb) - (va < vb);
+}